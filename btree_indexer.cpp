@@ -3,859 +3,7340 @@
 #include <fstream>
 #include <sstream>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <cstdlib>
+#include <cerrno>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <iomanip>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <deque>
+#include <condition_variable>
+#include <array>
+#include <utility>
+#include <memory>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
-// block size is constant at 1024 KB
+// size in bytes of every block of the index file, chosen at -create time and recorded in the metadata block
 int block_size = 1024;
 
+// the metadata fields always fit in the first 1024 bytes, the smallest block size
+const int metadata_size = 1024;
+
 // global variables that are populated by reading the first metadata block and re-used across the program
 int degree;
 int key_len;
-long root_address;
+atomic<long> root_address;
 string index_filename;
 string data_filename;
 
-/* class representing a B+ tree node 
+// node format of the open index, recorded in the metadata block
+// 1 - fixed-size keys (key_len + 1 bytes each), degree keys per node
+// 2 - per-node key prefix, separators truncated to their shortest distinguishing prefix, nodes split by size
+// 3 - format 2 with the data file pointers of leaves bit packed (see pack_pointers()) and the number of
+//     entries below each child recorded in internal nodes (order statistics, see rank_of())
+int format_version = 3;
+
+// identifies metadata blocks that carry a format version (written after the root address)
+const int index_magic = 0x58444e49;
+
+// fraction of a node's 2*degree capacity filled by the bulk loader during -create
+double fill_factor = 1.0;
+
+// covering index (-cover option, formats 2 and 3): every leaf entry also holds bytes
+// [cover_start, cover_start + cover_len) of its record (cover_len -1 - the rest of the record),
+// so -find and -list answer from the index without reading the data file
+// cover_len 0 - the leaves only hold data file pointers
+int cover_start = 0;
+int cover_len = 0;
+
+// end of the data file covered by the index and a fingerprint of the file up to there (see
+// data_fingerprint()), so -sync indexes only the lines appended since; both 0 in older indexes
+long synced_end = 0;
+unsigned long synced_fingerprint = 0;
+
+// copy-on-write updates (-cow option, see ShadowPaging): 1 if no committed block is ever overwritten
+int copy_on_write = 0;
+
+// integer key mode (-intkeys option, formats 2 and 3): every key is int_key_digits decimal digits
+// followed by key_len - int_key_digits arbitrary bytes, and is stored as the number it spells (the
+// digits base 10, then the other bytes base 256) in int_key_width big-endian bytes, so stored keys
+// order like the keys themselves and compare as integers. int_key_width 0 - keys are stored as they are
+// int_keys - integer key mode was asked for the index being created
+bool int_keys = false;
+int int_key_digits = 0;
+int int_key_width = 0;
+
+/* length in bytes of the keys as stored in the index */
+int stored_key_len()
+{
+    return int_key_width > 0 ? int_key_width : key_len;
+}
+
+/* bytes needed to store keys of 'digits' leading digits and key_len - digits other bytes as integers
  *
- * member variables:
- * address (long) - stores the offset in the index file where this node is written (-1 when not written)
- * is_leaf (boolean) - flag representing whether this is a leaf node or internal node
- * keys (vector<string>) - list of strings representing keys stored by this internal/leaf node
- * children (vector<long>) - list of offsets representing pointers to children nodes stored by this internal node
- * pointers (vector<long>) - list of offsets representing pointers to file offsets stored by this leaf node
- * next (long) - offset representing pointer to next sibling node for this leaf (-1 for internal or uninitialized nodes)
- * prev (long) - offset representing pointer to prev sibling node for this leaf (-1 for internal or uninitialized nodes)
+ * output (int) - 8 or 16, or 0 if not even 16 bytes hold every such key
+ */
+int int_key_bytes(int digits)
+{
+    // the numbers run up to 10^digits * 256^(key_len - digits) - 1; all 0xff bytes stay free for
+    // int_search_key()
+    long double values = powl(10.0L, digits) * powl(256.0L, key_len - digits);
+    for (int bytes : { 8, 16 })
+    {
+        if (values < powl(2.0L, 8 * bytes))
+            return bytes;
+    }
+    return 0;
+}
 
+/* the stored form of a key (key_len bytes) in integer key mode
+ *
+ * output (bool) - false if the key doesn't fit (a non-digit where a digit is expected); otherwise
+ *                 'stored' is set to the int_key_width big-endian bytes of its number
  */
-class Node
+bool int_key(const string &key, string &stored)
 {
-    public:
-    long address;
-    bool is_leaf;
-    vector<string> keys;
-    vector<long> children;
-    vector<long> pointers;
-    long next; // address of next block
-    long prev; // address of prev block
+    unsigned __int128 v = 0;
+    for (int i = 0 ; i < key_len ; i++)
+    {
+        unsigned char c = key[i];
+        if (i < int_key_digits && (c < '0' || c > '9'))
+            return false;
+        v = i < int_key_digits ? v * 10 + (c - '0') : v * 256 + c;
+    }
+    stored.assign(int_key_width, '\0');
+    for (int i = int_key_width - 1 ; i >= 0 ; i--, v >>= 8)
+        stored[i] = (char) (v & 0xff);
+    return true;
+}
 
-    /* read the Node from a specific address */
-    Node(long addr)
+/* the stored form to search for a key of any length in integer key mode: the stored form of the
+ * smallest key that fits the pattern and is not smaller than 'key', so searching for it finds the
+ * same place a byte-wise search for 'key' would
+ *
+ * input parameters:
+ * exact (bool) - set to whether that key is 'key' itself (only then can 'key' be in the index)
+ *
+ * output (string) - the stored form, or int_key_width 0xff bytes (larger than every stored key) if
+ *                   every key fitting the pattern is smaller than 'key'
+ */
+string int_search_key(const string &key, bool &exact)
+{
+    string k = key.substr(0, key_len);
+    exact = (int) key.length() == key_len;
+    bool lowered = (int) key.length() < key_len; // the rest of k is to be the smallest it can be
+    for (int i = 0 ; i < (int) k.length() && i < int_key_digits ; i++)
     {
-        address = addr;
-        read_from_disk();
+        if (k[i] >= '0' && k[i] <= '9')
+            continue;
+        exact = false;
+        if (k[i] < '0')
+            k.resize(i); // lower the rest, from this position on
+        else // increment the digits before this position
+        {
+            int carry = i - 1;
+            while (carry >= 0 && k[carry] == '9')
+                carry--;
+            if (carry < 0)
+                return string(int_key_width, '\xff');
+            k[carry]++;
+            k.resize(carry + 1);
+        }
+        lowered = true;
+        break;
+    }
+    if (lowered) // fill the rest with the smallest digits and bytes
+    {
+        while ((int) k.length() < key_len)
+            k += (int) k.length() < int_key_digits ? '0' : '\0';
     }
 
-    /* constructor for node with a single value */
-    Node(bool leaf, string key, long val, long ptr)
+    string stored;
+    int_key(k, stored);
+    if (!lowered && (int) key.length() > key_len) // 'key' extends k, so it is larger: take the next number
     {
-        is_leaf = leaf;
-        next = -1;
-        prev = -1;
-        address = -1;
+        int i = int_key_width - 1;
+        while (i >= 0 && stored[i] == '\xff')
+            stored[i--] = '\0';
+        if (i < 0)
+            return string(int_key_width, '\xff');
+        stored[i] = (char) ((unsigned char) stored[i] + 1);
+    }
+    return stored;
+}
 
-        keys.push_back(key);
+/* length of the common prefix of two keys */
+int common_prefix(const string &a, const string &b)
+{
+    int n = min(a.length(), b.length());
+    int i = 0;
+    while (i < n && a[i] == b[i])
+        i++;
+    return i;
+}
 
-        if (leaf)
-            pointers.push_back(val);
-        else
-            children.push_back(ptr);
+/* shortest separator key for two neighbouring nodes: the shortest prefix of right_first that is still
+ * larger than left_last (format 2 only - format 1 stores full keys)
+ */
+string separator_key(const string &left_last, const string &right_first)
+{
+    if (format_version == 1 || left_last.compare(right_first) >= 0)
+        return right_first;
+    return right_first.substr(0, common_prefix(left_last, right_first) + 1);
+}
+
+/* layout of a format 2 (and 3) node block:
+ * is_leaf (1 byte), next (8 bytes), prev (8 bytes), number of keys (2 bytes), prefix length (2 bytes),
+ * suffix width (2 bytes), 1 unused byte, then the prefix shared by all keys, then the key suffixes -
+ * either packed back to back when they all have the same width, or (width v2_variable) a slot
+ * directory of number of keys + 1 offsets followed by the suffix bytes - then the children or pointers
+ * (and in format 3 internal nodes, the number of leaf entries below each child, 8 bytes each)
+ */
+const int v2_header_size = 24;
+const int v2_variable = 0xffff;
+
+/* the leaves of a covering index follow the pointers with a second slot directory (number of keys + 1
+ * offsets) and the payload bytes. a payload is a tag byte and either the covered bytes themselves (0)
+ * or, when longer than inline_payload_limit(), the 8 byte index file address and 4 byte length of the
+ * bytes stored in overflow blocks (1)
+ */
+const char payload_inline = 0;
+const char payload_overflow = 1;
+
+long inline_payload_limit()
+{
+    return (block_size - v2_header_size) / 8;
+}
+
+// whether the AVX2 kernels can be used, detected by select_search_kernel()
+bool cpu_has_avx2 = false;
+
+// in-node search kernel for keys up to 32 bytes (-search option): false - the FixedWidthSearch
+// instantiation for the key width, true - the SSE2/AVX2 byte compares picked by CPU at run time
+bool use_simd_search = false;
+
+/* format 3 leaves store their data file pointers frame-of-reference bit packed: the smallest pointer
+ * (8 bytes), the bit width of the largest difference from it (1 byte), then every pointer minus the
+ * smallest in 'width' bits, back to back. 7 bytes of padding follow, so that every pointer can be read
+ * with a single unaligned 8 byte load. widths above 56 bits (which such a load can't always hold) are
+ * stored as whole 64 bit words.
+ */
+const int packed_header_size = 9;
+
+/* bit width needed to pack 'pointers', and their smallest value */
+int pointer_width(const vector<long> &pointers, long &base)
+{
+    base = pointers.empty() ? 0 : *min_element(pointers.begin(), pointers.end());
+    unsigned long range = pointers.empty() ? 0 : *max_element(pointers.begin(), pointers.end()) - base;
+    int width = range == 0 ? 0 : 64 - __builtin_clzl(range);
+    return width > 56 ? 64 : width;
+}
+
+/* bytes taken by 'count' packed pointers of 'width' bits, header and padding included */
+long packed_pointers_size(long count, int width)
+{
+    return packed_header_size + (count * width + 7) / 8 + 7;
+}
+
+/* write 'pointers' packed at 'out' (packed_pointers_size() bytes) */
+void pack_pointers(const vector<long> &pointers, char *out)
+{
+    long base;
+    int width = pointer_width(pointers, base);
+    unsigned char w = width;
+    memcpy(out, &base, sizeof(base));
+    memcpy(out + 8, &w, sizeof(w));
+
+    char *bits = out + packed_header_size;
+    memset(bits, 0, packed_pointers_size(pointers.size(), width) - packed_header_size);
+    for (size_t i = 0 ; width > 0 && i < pointers.size() ; i++)
+    {
+        long bit = i * width;
+        unsigned long word;
+        memcpy(&word, bits + bit / 8, sizeof(word));
+        word |= (unsigned long) (pointers[i] - base) << (bit % 8);
+        memcpy(bits + bit / 8, &word, sizeof(word));
     }
+}
 
-    /* constructor for nodes with multiple values */
-    Node(bool leaf, vector<string> keys_, vector<long> vals, vector<long> ptrs)
+/* the ith pointer of a packed section */
+long unpack_pointer(const char *packed, long i)
+{
+    long base;
+    memcpy(&base, packed, sizeof(base));
+    int width = (unsigned char) packed[8];
+    if (width == 0)
+        return base;
+
+    long bit = i * width;
+    unsigned long word;
+    memcpy(&word, packed + packed_header_size + bit / 8, sizeof(word));
+    word >>= bit % 8;
+    if (width < 64)
+        word &= (1UL << width) - 1;
+    return base + word;
+}
+
+#if defined(__x86_64__)
+/* unpack_pointers() four pointers at a time: one gather loads the 8 bytes holding each pointer,
+ * then a per-lane shift, mask and add of the base
+ */
+__attribute__((target("avx2")))
+void unpack_pointers_avx2(const char *packed, long count, long *out)
+{
+    long base;
+    memcpy(&base, packed, sizeof(base));
+    int width = (unsigned char) packed[8];
+    const long long *bits = (const long long*) (packed + packed_header_size);
+    __m256i vbase = _mm256_set1_epi64x(base);
+    __m256i mask = _mm256_set1_epi64x(width < 64 ? (1L << width) - 1 : -1L);
+    __m256i lane = _mm256_set_epi64x(3 * width, 2 * width, width, 0);
+    __m256i seven = _mm256_set1_epi64x(7);
+
+    long i = 0;
+    for ( ; i + 4 <= count ; i += 4)
     {
-        is_leaf = leaf;
-        next = -1;
-        prev = -1;
-        address = -1;
+        __m256i bit = _mm256_add_epi64(_mm256_set1_epi64x(i * width), lane);
+        __m256i word = _mm256_i64gather_epi64(bits, _mm256_srli_epi64(bit, 3), 1);
+        word = _mm256_srlv_epi64(word, _mm256_and_si256(bit, seven));
+        _mm256_storeu_si256((__m256i*) (out + i), _mm256_add_epi64(_mm256_and_si256(word, mask), vbase));
+    }
+    for ( ; i < count ; i++)
+        out[i] = unpack_pointer(packed, i);
+}
+#endif
 
-        keys = keys_;
+/* unpack the first 'count' pointers of a packed section into 'out' */
+void unpack_pointers(const char *packed, long count, long *out)
+{
+#if defined(__x86_64__)
+    if (cpu_has_avx2 && packed[8] != 0)
+    {
+        unpack_pointers_avx2(packed, count, out);
+        return;
+    }
+#endif
+    for (long i = 0 ; i < count ; i++)
+        out[i] = unpack_pointer(packed, i);
+}
 
-        if (leaf)
-            pointers = vals;
-        else
-            children = ptrs;
+/* class representing one open file accessed with positioned reads and writes
+ *
+ * The descriptor stays open for the life of the process, so reads and writes are a single
+ * pread()/pwrite() with no open/seek/close around them. The end of the file is tracked in memory
+ * and serves as the append cursor for new blocks and records. In direct mode the file is opened
+ * with O_DIRECT and unaligned caller buffers are staged through an aligned bounce buffer.
+ *
+ * member variables:
+ * fd (int) - the open file descriptor (-1 when closed)
+ * filename (string) - the file that fd refers to
+ * end_offset (long) - current end of the file, including space reserved by allocate()
+ * direct (bool) - whether the file was opened with O_DIRECT
+ * bounce (char *) - aligned staging buffer for direct I/O
+ * bounce_size (long) - size of bounce in bytes
+ */
+class BlockDevice
+{
+    public:
+    int fd;
+    string filename;
+    long end_offset;
+    bool direct;
+    char *bounce;
+    long bounce_size;
+
+    static const int alignment = 4096;
+
+    BlockDevice()
+    {
+        fd = -1;
+        end_offset = 0;
+        direct = false;
+        bounce = NULL;
+        bounce_size = 0;
     }
 
-    /* write a Node object to memory at the specified 'address'. Written either at
-     * 1.'address' if exists already then overwrite that block for block_size
-     * 2. append to end of file
+    /* open 'name' unless it is already the open file
+     *
+     * input parameters:
+     * name (string) - path of the file
+     * truncate (bool) - create the file or empty it if it exists
+     * use_direct (bool) - bypass the OS page cache with O_DIRECT when the file system allows it
+     *
+     * output (bool) - false if the file can't be opened
      */
-    void write_to_disk()
+    bool open(string name, bool truncate, bool use_direct)
     {
-        if (address == -1)
+        if (fd >= 0 && filename == name && !truncate)
+            return true;
+        close();
+
+        int flags = truncate ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR;
+        direct = false;
+#ifdef O_DIRECT
+        if (use_direct)
         {
-            // get end of file offset
-            ifstream infile;
-            infile.open(index_filename, ios::in | ios::binary);
-            infile.seekg(0, ios::end);
-            address = infile.tellg();
-            infile.close();
+            fd = ::open(name.c_str(), flags | O_DIRECT, 0644);
+            if (fd >= 0)
+                direct = true;
+            else
+                cout << "O_DIRECT is not supported for " << name << ", using buffered I/O\n";
         }
+#endif
+        if (fd < 0)
+            fd = ::open(name.c_str(), flags, 0644);
+        if (fd < 0 && !truncate) // read-only commands on a read-only file
+            fd = ::open(name.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
 
-        long offset = 0;
-        char buffer[1024];
-
-        // write is_leaf bool
-        memcpy(buffer + offset, &is_leaf, sizeof(is_leaf));
-        offset += sizeof(is_leaf);
+        struct stat st;
+        fstat(fd, &st);
+        end_offset = st.st_size;
+        filename = name;
+        return true;
+    }
 
-        // write next pointer
-        memcpy(buffer + offset, &next, sizeof(next));
-        offset += sizeof(next);
+    void close()
+    {
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+        filename = "";
+    }
 
-        // write prev pointer
-        memcpy(buffer + offset, &prev, sizeof(prev));
-        offset += sizeof(prev);
+    /* read up to len bytes at 'offset' into buf, zero-filling anything past the end of the file
+     *
+     * output (long int) - number of bytes actually read from the file
+     */
+    long read_at(long offset, char *buf, long len)
+    {
+        if (direct && !is_aligned(buf, offset, len))
+            return bounce_read(offset, buf, len);
 
-        // write number of keys in this node
-        long keys_size = keys.size();
-        memcpy(buffer + offset, &keys_size, sizeof(keys_size));
-        offset += sizeof(keys_size);
+        long done = 0;
+        while (done < len)
+        {
+            ssize_t n = pread(fd, buf + done, len - done, offset + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        if (done < len)
+            memset(buf + done, 0, len - done);
+        return done;
+    }
 
-        // write keys
-        for (string key : keys) 
+    /* write len bytes of buf at 'offset', extending the end of the file if needed */
+    void write_at(long offset, const char *buf, long len)
+    {
+        if (direct && !is_aligned(buf, offset, len))
         {
-            memcpy(buffer + offset, key.c_str(), strlen(key.c_str()) + 1);
-            offset += strlen(key.c_str()) + 1;
+            bounce_write(offset, buf, len);
+            return;
         }
 
-        // Add the child pointers to memory
-        if (is_leaf == false) // internal node - write long children 
+        long done = 0;
+        while (done < len)
         {
-            for (long child : children) 
+            ssize_t n = pwrite(fd, buf + done, len - done, offset + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
             {
-                memcpy(buffer + offset, &child, sizeof(child));
-                offset += sizeof(child);
+                cout << "Error writing " << filename << ": " << strerror(errno) << "\n";
+                exit(1);
             }
-        } 
-        else  // leaf node - write long pointers
+            done += n;
+        }
+        if (offset + len > end_offset)
+            end_offset = offset + len;
+    }
+
+    /* reserve len bytes at the end of the file
+     *
+     * output (long int) - offset of the reserved space
+     */
+    long allocate(long len)
+    {
+        long offset = end_offset;
+        end_offset += len;
+        return offset;
+    }
+
+    /* write len bytes of buf at the end of the file
+     *
+     * output (long int) - offset the bytes were written at
+     */
+    long append(const char *buf, long len)
+    {
+        long offset = end_offset;
+        write_at(offset, buf, len);
+        return offset;
+    }
+
+    void sync()
+    {
+        if (fd >= 0)
+            fdatasync(fd);
+    }
+
+    /* take in what other processes appended to the file since it was opened */
+    void reload_end()
+    {
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > end_offset)
+            end_offset = st.st_size;
+    }
+
+    /* discard everything past the first len bytes of the file */
+    void truncate(long len)
+    {
+        if (fd >= 0 && ftruncate(fd, len) == 0)
+            end_offset = len;
+    }
+
+    private:
+    bool is_aligned(const void *buf, long offset, long len)
+    {
+        return ((unsigned long) buf % alignment) == 0 && offset % alignment == 0 && len % alignment == 0;
+    }
+
+    /* grow the bounce buffer to cover [offset, offset+len) rounded out to the alignment */
+    long prepare_bounce(long offset, long len, long &start)
+    {
+        start = offset - offset % alignment;
+        long size = offset + len - start;
+        size = (size + alignment - 1) / alignment * alignment;
+        if (size > bounce_size)
         {
-            for (long ptr : pointers) 
+            free(bounce);
+            if (posix_memalign((void**) &bounce, alignment, size) != 0)
             {
-                memcpy(buffer + offset, &ptr, sizeof(ptr));
-                offset += sizeof(ptr);
+                cout << "Out of memory for direct I/O buffer\n";
+                exit(1);
             }
+            bounce_size = size;
         }
-
-        ofstream outfile;
-        outfile.open(index_filename, ios::out | ios::binary | ios::in);
-        outfile.seekp(address, ios::beg);
-        outfile.write(buffer, block_size);
-        outfile.close();
-
-        flush_node();
+        return size;
     }
 
-    /* delete the current Node from memory */
-    void flush_node()
+    long bounce_read(long offset, char *buf, long len)
     {
-        is_leaf = false;
-        next = -1;
-        prev = -1;
-        keys.clear();
-        children.clear();
-        pointers.clear();
+        long start;
+        long size = prepare_bounce(offset, len, start);
+        direct = false; // read the aligned range itself
+        long got = read_at(start, bounce, size);
+        direct = true;
+        memcpy(buf, bounce + (offset - start), len);
+        got -= offset - start;
+        return got < 0 ? 0 : (got > len ? len : got);
     }
 
-    /* read Node object from index file at 'address' */
-    void read_from_disk()
+    void bounce_write(long offset, const char *buf, long len)
     {
-        if (address <= 0) // block hasn't been written to disk yet, can't read it
-            return;
+        long start;
+        long size = prepare_bounce(offset, len, start);
+        direct = false;
+        read_at(start, bounce, size); // read-modify-write the surrounding aligned range
+        memcpy(bounce + (offset - start), buf, len);
+        long old_end = end_offset;
+        write_at(start, bounce, size);
+        direct = true;
 
-        char *buf = new char[block_size];
-        long offset = 0;
+        // the aligned write may have padded past the real end of the data
+        long real_end = max(old_end, offset + len);
+        if (end_offset > real_end)
+        {
+            if (ftruncate(fd, real_end) == 0)
+                end_offset = real_end;
+        }
+    }
+};
 
-        // Open the binary file and read into memory
-        ifstream infile;
-        infile.open(index_filename, ios::in | ios::binary);
-        infile.seekg(address);
-        infile.read(buf, block_size);
-        infile.close();
+// the open index file and data file, kept open across calls
+BlockDevice index_device;
+BlockDevice data_device;
 
-        // read is_leaf bool 
-        memcpy(&is_leaf, buf + offset, sizeof(bool));
-        offset += sizeof(is_leaf);
+// whether the index file is opened with O_DIRECT (-direct option)
+bool use_direct_io = false;
 
-        // read next addr pointer
-        memcpy(&next, buf + offset, sizeof(long));
-        offset += sizeof(long);
+/* class keeping many reads in flight at once for batched lookups and scans (-io option)
+ *
+ * Reads are queued with read() and handed to the backend by submit(); wait() returns the tag of the
+ * next finished read. The backend asked for with -io is only started by start(), which the batches
+ * and scans that read through the engine call first, so other commands set up no ring or threads.
+ * The backends:
+ * uring - Linux io_uring (set up through the raw system calls): one io_uring_enter() submits every
+ *         queued read and the kernel keeps them all in flight at the device
+ * threads - a pool of threads each doing blocking pread()s, used where io_uring is unavailable
+ * sync - every read is done when it is queued, one at a time (the plain synchronous path)
+ * Reads of an O_DIRECT file are always done synchronously, since its alignment rules are handled
+ * by BlockDevice::read_at().
+ *
+ * member variables:
+ * kind (string) - the backend in use
+ * requested (string) - the backend start() will open, empty once one was opened
+ * depth (int) - most reads handed to the backend at a time
+ * owner (mutex) - the engine serves one batch or scan at a time
+ * queued (deque<Request>) - reads not handed to the backend yet
+ * in_flight (int) - reads handed to the backend and not yet returned by wait()
+ * finished (deque<pair<long, long>>) - (tag, bytes read) of completed reads not yet returned by wait()
+ */
+class IoEngine
+{
+    public:
+    struct Request
+    {
+        int fd;
+        char *buf;
+        long len;
+        long offset;
+        long tag;
+    };
 
-        // read prev addr pointer
-        memcpy(&prev, buf + offset, sizeof(long));
-        offset += sizeof(long);
+    string kind;
+    string requested;
+    int depth;
+    mutex owner; // held by the batch or scan using the engine; others take the synchronous path
+    deque<Request> queued;
+    int in_flight;
+    deque<pair<long, long> > finished;
 
-        // read the number of keys stored
-        long keys_size;
-        memcpy(&keys_size, buf + offset, sizeof(keys_size));
-        offset += sizeof(keys_size);
+    IoEngine()
+    {
+        kind = "sync";
+        depth = 64;
+        in_flight = 0;
+        ring_fd = -1;
+        stopping = false;
+    }
 
-        // read the keys
-        keys.clear();
-        for (int i = 0 ; i < keys_size ; i++) 
+    ~IoEngine()
+    {
+        close();
+    }
+
+    /* start the requested backend, falling back from uring to threads if the kernel refuses io_uring
+     *
+     * output (string) - the backend started
+     */
+    string open(string backend)
+    {
+        close();
+        requested.clear();
+        kind = backend;
+        if (kind == "uring" && !setup_ring())
+            kind = "threads";
+        if (kind == "threads")
         {
-            string key(buf + offset, key_len); // keylen
-            offset += key_len + 1; // keylen + 1 to account for '\0' character
-            keys.push_back(key);
+            stopping = false;
+            for (int i = 0 ; i < min(depth, 16) ; i++)
+                workers.push_back(thread(&IoEngine::work, this));
         }
+        return kind;
+    }
 
-        if (is_leaf == false) // internal node - read children 
+    /* open the backend asked for with -io if it isn't running yet (called with 'owner' held) */
+    void start()
+    {
+        if (!requested.empty())
+            open(requested);
+    }
+
+    void close()
+    {
+        if (!workers.empty())
         {
-            children.clear();
+            {
+                lock_guard<mutex> guard(work_mutex);
+                stopping = true;
+            }
+            work_ready.notify_all();
+            for (thread &t : workers)
+                t.join();
+            workers.clear();
+        }
+#if defined(__linux__)
+        if (ring_fd >= 0)
+        {
+            munmap(sq_ring, sq_ring_size);
+            if (cq_ring != sq_ring)
+                munmap(cq_ring, cq_ring_size);
+            munmap(sqes, sqes_size);
+            ::close(ring_fd);
+            ring_fd = -1;
+        }
+#endif
+        queued.clear();
+        finished.clear();
+        in_flight = 0;
+        kind = "sync";
+    }
+
+    /* queue a read of len bytes at 'offset' of 'device' into buf, identified by 'tag' in wait() */
+    void read(BlockDevice &device, char *buf, long len, long offset, long tag)
+    {
+        if (kind == "sync" || device.direct)
+        {
+            finished.push_back(make_pair(tag, device.read_at(offset, buf, len)));
+            return;
+        }
+        queued.push_back({ device.fd, buf, len, offset, tag });
+    }
+
+    /* hand the queued reads to the backend, up to 'depth' in flight; reads io_uring doesn't take
+     * (EAGAIN, EBUSY or a short submit) stay queued for the next call
+     */
+    void submit()
+    {
+        if (kind == "threads")
+        {
+            int added = 0;
+            {
+                lock_guard<mutex> guard(work_mutex);
+                for ( ; !queued.empty() && in_flight < depth ; added++)
+                {
+                    work_queue.push_back(queued.front());
+                    queued.pop_front();
+                    in_flight++;
+                }
+            }
+            for (int i = 0 ; i < added ; i++) // wake one worker per read rather than all of them
+                work_ready.notify_one();
+        }
+#if defined(__linux__)
+        else if (kind == "uring")
+        {
+            while (true)
+            {
+                unsigned tail = *sq_tail;
+                vector<int> added; // slots of the entries put in the ring, in ring order
+                while (!queued.empty() && in_flight < depth)
+                {
+                    const Request &r = queued.front();
+                    unsigned idx = tail & *sq_mask;
+                    io_uring_sqe *sqe = &sqes[idx];
+                    memset(sqe, 0, sizeof(*sqe));
+                    sqe->opcode = IORING_OP_READ;
+                    sqe->fd = r.fd;
+                    sqe->addr = (unsigned long) r.buf;
+                    sqe->len = r.len;
+                    sqe->off = r.offset;
+                    sqe->user_data = free_slots.back();
+                    sq_array[idx] = idx;
+                    pending[free_slots.back()] = r;
+                    added.push_back(free_slots.back());
+                    free_slots.pop_back();
+                    queued.pop_front();
+                    tail++;
+                    in_flight++;
+                }
+                if (added.empty())
+                    return;
+                __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+                int submitted;
+                do
+                    submitted = enter(added.size(), 0);
+                while (submitted < 0 && errno == EINTR);
+                if (submitted < 0 && errno != EAGAIN && errno != EBUSY)
+                {
+                    cout << "io_uring submit failed: " << strerror(errno) << "\n";
+                    exit(1);
+                }
+                submitted = max(submitted, 0);
+
+                // the kernel takes entries in ring order, so the ones it left are the last ones: take them
+                // out of the ring and queue them again for the next submit()
+                int left = added.size() - submitted;
+                __atomic_store_n(sq_tail, tail - left, __ATOMIC_RELEASE);
+                for (int i = added.size() - 1 ; i >= submitted ; i--)
+                {
+                    queued.push_front(pending[added[i]]);
+                    free_slots.push_back(added[i]);
+                    in_flight--;
+                }
+                if (left == 0 || in_flight > 0)
+                    return; // reads still in flight free up the kernel's resources as they are reaped
+                this_thread::yield(); // nothing to wait for, so try again
+            }
+        }
+#endif
+    }
+
+    /* wait for the next read to finish
+     *
+     * input parameters:
+     * bytes (long) - set to the number of bytes read (short at the end of the file)
+     *
+     * output (long int) - the tag of the read, or -1 when nothing is queued or in flight
+     */
+    long wait(long &bytes)
+    {
+        if (finished.empty() && in_flight == 0)
+            submit();
+        if (finished.empty() && in_flight > 0)
+            reap();
+        if (finished.empty())
+            return -1;
+
+        pair<long, long> done = finished.front();
+        finished.pop_front();
+        bytes = done.second;
+        submit(); // refill the backend as reads complete
+        return done.first;
+    }
+
+    private:
+    vector<thread> workers;
+    deque<Request> work_queue;
+    deque<pair<long, long> > completed;
+    mutex work_mutex;
+    condition_variable work_ready;
+    condition_variable work_done;
+    bool stopping;
+
+    int ring_fd;
+#if defined(__linux__)
+    void *sq_ring;
+    void *cq_ring;
+    long sq_ring_size, cq_ring_size, sqes_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+    vector<Request> pending; // reads in flight in the ring, indexed by user_data (one slot per depth)
+    vector<int> free_slots;  // slots of 'pending' not in flight
+
+    bool setup_ring()
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+        if (ring_fd < 0)
+            return false;
+
+        sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+        sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring :
+                  mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*) mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            ::close(ring_fd);
+            ring_fd = -1;
+            return false;
+        }
+
+        char *sq = (char*) sq_ring;
+        char *cq = (char*) cq_ring;
+        sq_tail = (unsigned*) (sq + p.sq_off.tail);
+        sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+        sq_array = (unsigned*) (sq + p.sq_off.array);
+        cq_head = (unsigned*) (cq + p.cq_off.head);
+        cq_tail = (unsigned*) (cq + p.cq_off.tail);
+        cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*) (cq + p.cq_off.cqes);
+        depth = min((unsigned) depth, p.sq_entries);
+        pending.assign(depth, Request());
+        free_slots.clear();
+        for (int slot = depth - 1 ; slot >= 0 ; slot--)
+            free_slots.push_back(slot);
+        return true;
+    }
+
+    int enter(unsigned to_submit, unsigned min_complete)
+    {
+        return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                       min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    }
+#endif
+
+    /* move at least one completed read to 'finished', blocking until there is one */
+    void reap()
+    {
+        if (kind == "threads")
+        {
+            unique_lock<mutex> lock(work_mutex);
+            work_done.wait(lock, [this] { return !completed.empty(); });
+            while (!completed.empty())
+            {
+                finished.push_back(completed.front());
+                completed.pop_front();
+                in_flight--;
+            }
+            return;
+        }
+#if defined(__linux__)
+        while (true)
+        {
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail)
+            {
+                if (enter(0, 1) < 0 && errno != EINTR)
+                {
+                    cout << "io_uring wait failed: " << strerror(errno) << "\n";
+                    exit(1);
+                }
+                continue;
+            }
+            for ( ; head != tail ; head++)
+            {
+                io_uring_cqe *cqe = &cqes[head & *cq_mask];
+                Request &r = pending[cqe->user_data];
+                long bytes = cqe->res;
+                if (bytes >= 0 && bytes < r.len)
+                    bytes += full_read(r.fd, r.buf + bytes, r.len - bytes, r.offset + bytes); // finish a short read
+                else if (bytes < 0)
+                    bytes = full_read(r.fd, r.buf, r.len, r.offset);
+                finished.push_back(make_pair(r.tag, bytes));
+                free_slots.push_back(cqe->user_data);
+                in_flight--;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            return;
+        }
+#endif
+    }
+
+    /* pread() until len bytes are read or the file ends
+     *
+     * output (long int) - bytes read
+     */
+    static long full_read(int fd, char *buf, long len, long offset)
+    {
+        long done = 0;
+        while (done < len)
+        {
+            ssize_t n = pread(fd, buf + done, len - done, offset + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        return done;
+    }
+
+    /* worker thread of the threads backend */
+    void work()
+    {
+        while (true)
+        {
+            Request r;
+            {
+                unique_lock<mutex> lock(work_mutex);
+                work_ready.wait(lock, [this] { return stopping || !work_queue.empty(); });
+                if (work_queue.empty())
+                    return;
+                r = work_queue.front();
+                work_queue.pop_front();
+            }
+            long bytes = full_read(r.fd, r.buf, r.len, r.offset);
+            {
+                lock_guard<mutex> guard(work_mutex);
+                completed.push_back(make_pair(r.tag, bytes));
+            }
+            work_done.notify_one();
+        }
+    }
+};
+
+// the I/O engine used by -findbatch and -list (-io option)
+IoEngine io_engine;
+
+/* 64 bit FNV-1a hash of len bytes of buf, continuing from 'hash' */
+unsigned long fnv1a(const char *buf, long len, unsigned long hash = 14695981039346656037UL)
+{
+    for (long i = 0 ; i < len ; i++)
+        hash = (hash ^ (unsigned char) buf[i]) * 1099511628211UL;
+    return hash;
+}
+
+/* class representing the redo log of an index file (<index file>.wal, -wal option)
+ *
+ * With the log active, inserts change blocks only in the buffer pool. commit() appends the image of
+ * every block changed since the previous commit and the current root address to the log as one
+ * checksummed group and syncs the log once for the whole group, so a batch of inserts shares a
+ * single fsync. A logged block may reach the index file at any time afterwards; a checkpoint writes
+ * them all, records the root in the metadata block and empties the log. Opening an index replays the
+ * committed groups into 'replayed', which the buffer pool reads those blocks from, so a process
+ * writing through the log carries on appending to it and only checkpoints once it passes
+ * checkpoint_bytes, when -serve stops or with -checkpoint.
+ *
+ * A process writing through the log holds an exclusive flock() on it for as long as it runs, and
+ * only the holder of that lock writes logged blocks into the index file, checkpoints or truncates
+ * the log. A process that changes the index without the log ('fold') checkpoints it first if it can
+ * take the lock; one that only reads leaves the log as it is.
+ *
+ * group layout: magic (4 bytes), block count (4 bytes), root address (8 bytes), checksum of the root
+ * and the blocks (8 bytes), then per block its address (8 bytes) and block_size bytes of contents
+ *
+ * member variables:
+ * device (BlockDevice) - the log file
+ * active (bool) - whether inserts are logged (-wal option)
+ * fold (bool) - whether this process changes the index without the log, so the log goes into it first
+ * owner (bool) - whether this process holds the lock on the log
+ * replayed (unordered_map<long, string>) - latest logged contents of every block not written to the
+ *                                          index file since the log was opened
+ * checkpoint_bytes (long) - log size that triggers a checkpoint (-walsize option, in MB)
+ * commits, pages (long) - statistics reported by print_stats()
+ */
+class WriteAheadLog
+{
+    public:
+    BlockDevice device;
+    bool active;
+    bool fold;
+    bool owner;
+    unordered_map<long, string> replayed;
+    long checkpoint_bytes;
+    long commits;
+    long pages;
+
+    static const unsigned int group_magic = 0x474c4157;
+    static const int group_header_size = 24;
+
+    WriteAheadLog()
+    {
+        active = false;
+        fold = false;
+        owner = false;
+        checkpoint_bytes = 64L * 1024 * 1024;
+        commits = pages = 0;
+    }
+
+    static string log_name(const string &index_file)
+    {
+        return index_file + ".wal";
+    }
+
+    /* open the log of 'index_file', creating it only when logging is active
+     *
+     * output (bool) - whether there is a log to recover from or append to
+     */
+    bool open(const string &index_file)
+    {
+        string name = log_name(index_file);
+        bool exists = access(name.c_str(), F_OK) == 0;
+        if (!active && !exists)
+            return false;
+        return device.open(name, !exists, false);
+    }
+
+    /* take the lock on the log: a writer waits for it and keeps it until it exits, a reader only takes it
+     * if it is free
+     *
+     * output (bool) - whether this process holds the lock, and so may write the log into the index file
+     */
+    bool lock()
+    {
+        owner = flock(device.fd, LOCK_EX | LOCK_NB) == 0;
+        if (!owner && active)
+        {
+            cout << "Waiting for redo log " << device.filename << ", which another process is using" << endl;
+            if (flock(device.fd, LOCK_EX) != 0)
+            {
+                cout << "Cannot lock redo log " << device.filename << ": " << strerror(errno) << "\n";
+                exit(1);
+            }
+            owner = true;
+        }
+        return owner;
+    }
+
+    /* let other processes take the log once this one has emptied it (readers don't keep the lock) */
+    void unlock()
+    {
+        flock(device.fd, LOCK_UN);
+        owner = false;
+    }
+
+    /* replay the blocks of every complete group into 'replayed'
+     * a group cut short by a crash or a stretch the log doesn't hold a group in ends the replay only if no
+     * complete group follows it
+     *
+     * output (long int) - the root address recorded by the last complete group, -1 if there is none
+     */
+    long recover()
+    {
+        long root = -1;
+        long offset = 0;
+        vector<char> body;
+        while (offset < device.end_offset)
+        {
+            long group_root;
+            long len = read_group(offset, body, group_root);
+            if (len < 0)
+            {
+                offset = next_group(offset + 1);
+                if (offset < 0)
+                    break;
+                continue;
+            }
+
+            for (long pos = 0 ; pos < (long) body.size() ; pos += sizeof(long) + block_size)
+            {
+                long address;
+                memcpy(&address, body.data() + pos, sizeof(address));
+                replayed[address].assign(body.data() + pos + sizeof(address), block_size);
+                // blocks appended since the last checkpoint may exist only in the log
+                index_device.end_offset = max(index_device.end_offset, address + block_size);
+            }
+            root = group_root;
+            offset += len;
+        }
+        return root;
+    }
+
+    /* append one group holding 'blocks' (address, contents) and 'root', then sync the log */
+    void commit(const vector<pair<long, const char*>> &blocks, long root)
+    {
+        unsigned int count = blocks.size();
+        vector<char> group(group_header_size + count * (sizeof(long) + block_size));
+        long pos = group_header_size;
+        for (const pair<long, const char*> &block : blocks)
+        {
+            memcpy(group.data() + pos, &block.first, sizeof(long));
+            memcpy(group.data() + pos + sizeof(long), block.second, block_size);
+            pos += sizeof(long) + block_size;
+        }
+        unsigned long checksum = fnv1a(group.data() + group_header_size, pos - group_header_size,
+                                       fnv1a((char*) &root, sizeof(root)));
+        memcpy(group.data(), &group_magic, 4);
+        memcpy(group.data() + 4, &count, 4);
+        memcpy(group.data() + 8, &root, 8);
+        memcpy(group.data() + 16, &checksum, 8);
+
+        // append at the real end of the file, whatever happened to it since it was opened
+        struct stat st;
+        if (fstat(device.fd, &st) == 0)
+            device.end_offset = st.st_size;
+        device.append(group.data(), group.size());
+        device.sync();
+        commits++;
+        pages += count;
+    }
+
+    /* empty the log once everything in it has reached the index file */
+    void reset()
+    {
+        device.truncate(0);
+        device.sync();
+    }
+
+    void print_stats()
+    {
+        cout << "Redo log: " << commits << " commits, " << pages << " blocks logged\n";
+    }
+
+    private:
+    /* read the group at 'offset' into body (its blocks) and root
+     *
+     * output (long int) - the length of the group, -1 if no complete group with a valid checksum starts there
+     */
+    long read_group(long offset, vector<char> &body, long &root)
+    {
+        char header[group_header_size];
+        if (device.read_at(offset, header, group_header_size) < group_header_size)
+            return -1;
+        unsigned int magic, count;
+        unsigned long checksum;
+        memcpy(&magic, header, 4);
+        memcpy(&count, header + 4, 4);
+        memcpy(&root, header + 8, 8);
+        memcpy(&checksum, header + 16, 8);
+        long len = count * (sizeof(long) + block_size);
+        if (magic != group_magic || offset + group_header_size + len > device.end_offset)
+            return -1;
+
+        body.resize(len);
+        if (device.read_at(offset + group_header_size, body.data(), len) < len)
+            return -1;
+        if (fnv1a(body.data(), len, fnv1a((char*) &root, sizeof(root))) != checksum)
+            return -1;
+        return group_header_size + len;
+    }
+
+    /* offset of the first complete group at or after 'offset', -1 if there is none */
+    long next_group(long offset)
+    {
+        if (offset >= device.end_offset)
+            return -1;
+        vector<char> tail(device.end_offset - offset);
+        device.read_at(offset, tail.data(), tail.size());
+        vector<char> body;
+        long root;
+        for (long pos = 0 ; pos + 4 <= (long) tail.size() ; pos++)
+        {
+            if (memcmp(tail.data() + pos, &group_magic, 4) == 0 && read_group(offset + pos, body, root) > 0)
+                return offset + pos;
+        }
+        return -1;
+    }
+};
+
+// the redo log of the open index file
+WriteAheadLog wal;
+
+/* class representing a fixed-size cache of index file blocks that all Node I/O goes through
+ *
+ * Blocks are read into frames on a miss and stay cached until evicted. A pinned frame is never
+ * evicted; unpinned frames are kept in least-recently-used order and the oldest one is reused on a
+ * miss. Modified (dirty) frames are written back when evicted or on flush().
+ *
+ * The pool may be shared by several threads: pool_mutex guards the page table, the LRU list and the
+ * frame bookkeeping, and every frame carries a reader/writer latch that latch()/unlatch() take on
+ * top of a pin. A thread never waits for a latch while holding pool_mutex, and no disk I/O of a miss
+ * happens under it: the frame goes into the page table marked 'loading' with its latch held
+ * exclusively, and the write-back of the block it held before and the read of the new one run with
+ * the mutex released. Other threads pinning the block wait on the frame's latch; one missing on the
+ * block still being written back waits until the write is done.
+ *
+ * member variables:
+ * capacity (int) - number of frames, i.e. the memory budget divided by block_size
+ * frames (vector<Frame>) - the cached blocks, reserved up front so a Frame never moves
+ * page_table (unordered_map<long, int>) - index file address -> frame holding that block
+ * lru (list<int>) - unpinned frames, least recently used first
+ * unlogged (int) - number of frames changed since the last redo log commit
+ * writing_back (unordered_set<long>) - evicted dirty blocks whose write-back is in progress
+ * hits, misses, writes (long) - statistics reported by print_stats()
+ * pool_mutex (mutex) - serializes access to all of the above
+ * written (condition_variable) - signalled when a write-back finishes
+ */
+class BufferPool
+{
+    public:
+    struct Frame
+    {
+        long address;
+        char *data;
+        int pin_count;
+        bool dirty;
+        bool unlogged; // changed since the last log commit, so it must not reach the index file yet
+        bool loading;  // the block is being read into the frame, whose latch is held exclusively meanwhile
+        list<int>::iterator lru_pos;
+        shared_mutex *latch; // protects the block contents while it is read or modified
+    };
+
+    int capacity;
+    vector<Frame> frames;
+    unordered_map<long, int> page_table;
+    list<int> lru;
+    unordered_set<long> writing_back;
+    long hits;
+    long misses;
+    long writes;
+    int unlogged;
+    mutex pool_mutex;
+    condition_variable written;
+
+    BufferPool()
+    {
+        capacity = 0;
+        unlogged = 0;
+        hits = misses = writes = 0;
+    }
+
+    /* drop all cached blocks and size the pool for the currently open index file
+     *
+     * input parameters:
+     * budget (long) - memory budget in bytes for cached blocks
+     */
+    void open(long budget)
+    {
+        flush();
+        lock_guard<mutex> guard(pool_mutex);
+        for (Frame &f : frames)
+        {
+            free(f.data);
+            delete f.latch;
+        }
+        frames.clear();
+        page_table.clear();
+        lru.clear();
+        unlogged = 0;
+
+        capacity = budget / block_size;
+        if (capacity < 16) // a descent pins at most a couple of blocks at a time
+            capacity = 16;
+        frames.reserve(capacity);
+
+        if (index_device.end_offset < block_size) // the metadata block is always reserved
+            index_device.end_offset = block_size;
+    }
+
+    /* reserve the block at the end of the index file for a new node (or a run of consecutive blocks)
+     *
+     * output (long int) - the address of the new block
+     */
+    long allocate(long blocks = 1)
+    {
+        lock_guard<mutex> guard(pool_mutex);
+        return index_device.allocate(blocks * block_size);
+    }
+
+    /* give back the block at 'address' if nothing has been allocated after it */
+    void release(long address)
+    {
+        lock_guard<mutex> guard(pool_mutex);
+        if (address + block_size == index_device.end_offset)
+            index_device.end_offset = address;
+    }
+
+    /* bring the block at 'address' into the pool and pin it
+     *
+     * input parameters:
+     * address (long) - offset of the block in the index file
+     * read (bool) - false when the caller overwrites the whole block, so there is no need to read it
+     *
+     * output (char *) - the cached block, valid until unpin()
+     */
+    char* pin(long address, bool read=true)
+    {
+        unique_lock<mutex> guard(pool_mutex);
+        return frames[pin_frame(address, read, false, guard)].data;
+    }
+
+    /* pin the block at 'address' for a caller that reads it itself (through io_engine) if it isn't cached
+     *
+     * input parameters:
+     * cached (bool) - set to false when the returned frame is empty; the caller then reads the block
+     *                 into it and calls filled(), and until then the frame's latch is held exclusively
+     *                 so latch() callers wait for the block
+     *
+     * output (char *) - the frame of the block, valid until unpin()
+     */
+    char* pin_for_read(long address, bool &cached)
+    {
+        unique_lock<mutex> guard(pool_mutex);
+        // blocks replayed from the redo log come from wal.replayed, never the file
+        cached = page_table.find(address) != page_table.end() || wal.replayed.count(address) > 0;
+        return frames[pin_frame(address, cached, !cached, guard)].data;
+    }
+
+    /* the block pinned by pin_for_read() has been read into its frame
+     *
+     * output (char *) - the frame of the block, still pinned
+     */
+    char* filled(long address)
+    {
+        Frame *f;
+        {
+            lock_guard<mutex> guard(pool_mutex);
+            f = &frames[page_table[address]];
+            f->loading = false;
+        }
+        f->latch->unlock();
+        return f->data;
+    }
+
+    /* release a block pinned by pin(), marking it dirty if the caller modified it */
+    void unpin(long address, bool dirty)
+    {
+        lock_guard<mutex> guard(pool_mutex);
+        Frame &f = frames[page_table[address]];
+        f.dirty = f.dirty || dirty;
+        if (dirty && wal.active && !f.unlogged)
+        {
+            f.unlogged = true;
+            unlogged++;
+        }
+        if (--f.pin_count == 0)
+            f.lru_pos = lru.insert(lru.end(), page_table[address]);
+    }
+
+    /* pin the block at 'address' and take its latch, shared for readers or exclusive for a writer
+     *
+     * output (char *) - the cached block, valid until unlatch()
+     */
+    char* latch(long address, bool exclusive)
+    {
+        Frame *f;
+        {
+            unique_lock<mutex> guard(pool_mutex);
+            f = &frames[pin_frame(address, true, false, guard)];
+        }
+        if (exclusive)
+            f->latch->lock();
+        else
+            f->latch->lock_shared();
+        return f->data;
+    }
+
+    /* release a latch taken by latch() and unpin the block */
+    void unlatch(long address, bool exclusive, bool dirty)
+    {
+        Frame *f;
+        {
+            lock_guard<mutex> guard(pool_mutex);
+            f = &frames[page_table[address]];
+        }
+        if (exclusive)
+            f->latch->unlock();
+        else
+            f->latch->unlock_shared();
+        unpin(address, dirty);
+    }
+
+    /* write every dirty block back to the index file
+     * (called between inserts, when no block is exclusively latched)
+     */
+    void flush()
+    {
+        lock_guard<mutex> guard(pool_mutex);
+        for (Frame &f : frames)
+        {
+            if (f.dirty)
+            {
+                write_block(f.address, f.data);
+                f.dirty = false;
+            }
+        }
+    }
+
+    /* forget every cached block that isn't pinned, since another process may have rewritten it
+     * (called between commits, when no cached block is dirty)
+     */
+    void discard()
+    {
+        lock_guard<mutex> guard(pool_mutex);
+        for (int idx : lru)
+        {
+            Frame &f = frames[idx];
+            if (f.dirty)
+                write_block(f.address, f.data);
+            page_table.erase(f.address);
+            f.address = -1;
+            f.dirty = false;
+        }
+    }
+
+    /* append every block changed since the last commit to the redo log as one group with 'root' */
+    void log_changes(long root)
+    {
+        lock_guard<mutex> guard(pool_mutex);
+        vector<pair<long, const char*>> blocks;
+        for (Frame &f : frames)
+        {
+            if (f.unlogged)
+                blocks.push_back(make_pair(f.address, (const char*) f.data));
+            f.unlogged = false;
+        }
+        unlogged = 0;
+        wal.commit(blocks, root);
+    }
+
+    void print_stats(ostream &out = cout)
+    {
+        lock_guard<mutex> guard(pool_mutex);
+        out << "Buffer pool: " << hits << " hits, " << misses << " misses, " << writes << " block writes ("
+             << frames.size() << " of " << capacity << " frames used)\n";
+    }
+
+    private:
+    /* finds or loads the frame holding 'address' and pins it; called with pool_mutex held through
+     * 'guard', which is released on return (and while the block is read or the frame written back)
+     *
+     * input parameters:
+     * read (bool) - false when the caller fills the frame itself, so it is only cleared
+     * keep_latched (bool) - on a miss, return with the frame still loading and its latch held
+     *                       exclusively, until the caller calls filled() (see pin_for_read())
+     *
+     * output (int) - index of the frame in 'frames'
+     */
+    int pin_frame(long address, bool read, bool keep_latched, unique_lock<mutex> &guard)
+    {
+        written.wait(guard, [&] { return writing_back.count(address) == 0; });
+        unordered_map<long, int>::iterator it = page_table.find(address);
+        if (it != page_table.end())
+        {
+            hits++;
+            int idx = it->second;
+            Frame &f = frames[idx];
+            if (f.pin_count++ == 0)
+                lru.erase(f.lru_pos);
+            bool loading = f.loading;
+            guard.unlock();
+            if (loading) // wait for the thread reading the block
+            {
+                f.latch->lock_shared();
+                f.latch->unlock_shared();
+            }
+            return idx;
+        }
+
+        misses++;
+        long evicted = -1;
+        int idx = get_free_frame(evicted);
+        Frame &f = frames[idx];
+        f.address = address;
+        f.pin_count = 1;
+        f.dirty = false;
+        f.unlogged = false;
+        f.loading = true;
+        f.latch->lock(); // a frame just taken over has no pins, so nobody holds its latch
+        page_table[address] = idx;
+
+        if (address + block_size > index_device.end_offset)
+            index_device.end_offset = address + block_size;
+
+        // blocks replayed from the redo log are copied from it, so the file is only read for the others
+        bool from_file = read;
+        if (read && !wal.replayed.empty())
+        {
+            unordered_map<long, string>::iterator logged = wal.replayed.find(address);
+            if (logged != wal.replayed.end())
+            {
+                memcpy(f.data, logged->second.data(), block_size);
+                from_file = false;
+            }
+        }
+        guard.unlock();
+
+        if (evicted != -1)
+        {
+            index_device.write_at(evicted, f.data, block_size);
+            guard.lock();
+            writing_back.erase(evicted);
+            guard.unlock();
+            written.notify_all();
+        }
+        if (from_file)
+            index_device.read_at(address, f.data, block_size);
+        else if (!read)
+            memset(f.data, 0, block_size);
+        if (!keep_latched)
+        {
+            guard.lock();
+            f.loading = false;
+            guard.unlock();
+            f.latch->unlock();
+        }
+        return idx;
+    }
+
+    /* returns an unused frame, evicting the least recently used unpinned block when the pool is full
+     * (pool_mutex must be held)
+     *
+     * input parameters:
+     * evicted (long) - set to the address of the dirty block still in the frame, which the caller
+     *                  writes back; it is in writing_back until then
+     */
+    int get_free_frame(long &evicted)
+    {
+        if (frames.size() < (size_t) capacity)
+        {
+            Frame f;
+            if (posix_memalign((void**) &f.data, BlockDevice::alignment, block_size) != 0)
+            {
+                cout << "Out of memory for buffer pool frames\n";
+                exit(1);
+            }
+            f.pin_count = 0;
+            f.dirty = false;
+            f.unlogged = false;
+            f.loading = false;
+            f.latch = new shared_mutex();
+            frames.push_back(f);
+            return frames.size() - 1;
+        }
+
+        // blocks changed since the last log commit stay cached until the commit
+        list<int>::iterator pos = lru.begin();
+        while (pos != lru.end() && frames[*pos].unlogged)
+            pos++;
+        if (pos == lru.end())
+        {
+            cout << "Buffer pool exhausted: all " << capacity << " frames are pinned or not yet logged\n";
+            exit(1);
+        }
+
+        int idx = *pos;
+        lru.erase(pos);
+        Frame &victim = frames[idx];
+        if (victim.dirty)
+        {
+            writes++;
+            wal.replayed.erase(victim.address); // the file gets a newer copy than the log replay
+            writing_back.insert(victim.address);
+            evicted = victim.address;
+        }
+        page_table.erase(victim.address);
+        return idx;
+    }
+
+    void write_block(long address, const char *buf)
+    {
+        writes++;
+        wal.replayed.erase(address); // the file now holds a newer copy than the log replay
+        index_device.write_at(address, buf, block_size);
+    }
+};
+
+// memory budget of the buffer pool in bytes (-cache option, in KB)
+long buffer_pool_budget = 4 * 1024 * 1024;
+
+// the single buffer pool shared by every Node of the open index file
+BufferPool buffer_pool;
+
+// guards root_address: lookups hold it shared until the root block is latched, an insert holds it
+// exclusively for as long as the root may be split
+shared_mutex root_latch;
+
+/* signature for update_metadata function */
+void update_metadata();
+
+/* class implementing the copy-on-write updates of an index created with -cow (shadow paging)
+ *
+ * A block that a commit points at is never overwritten. Node::write_to_disk() moves every node an
+ * insert changes to a block of its own (relocate()), so its parent changes as well, up to a new root.
+ * commit() writes and syncs the new blocks first and only then the commit record naming the new
+ * root. The metadata block has room for two records, in different sectors, which commits overwrite in
+ * turn, so a crash while one is written leaves the previous commit intact; opening the index takes the
+ * valid record with the highest transaction number. A reader that opened the tree of a commit keeps
+ * reading that tree, however many commits follow, without taking a lock.
+ *
+ * The blocks a commit replaces go on a free list together with the number of the commit that freed
+ * them, and are reused oldest first. The list is stored in chunks that are only ever appended: a
+ * commit writes the blocks it freed to a new chunk naming the chunk written before it, and the commit
+ * record names the newest chunk, how many chunks are still in use and how many entries of the oldest
+ * one have been reused, so a commit writes one chunk however long the list is. Once every entry of
+ * the oldest chunk has been reused, the chunk's own block is freed like any other. A block is reused
+ * only once no reader can still be on a tree older than the commit that freed it: every process with the index open keeps the
+ * oldest transaction it reads in its slot of <index file>.readers (a small shared mapping), and the
+ * threads of one process are counted in 'snapshots'. Writers take turns through flock() on the index
+ * file, from begin() to commit().
+ *
+ * commit record layout (record_size bytes ending each half of the first metadata_size bytes):
+ * transaction number, root address, newest free list chunk, number of chunks in use, entries of the
+ * oldest chunk already reused, checksum of the five (8 bytes each)
+ * free list chunk layout: the chunk written before it (8 bytes), entry count (4 bytes), then per entry
+ * the block address and the transaction that freed it (8 bytes each)
+ *
+ * member variables:
+ * active (bool) - whether the open index is copy-on-write
+ * open (bool) - whether this process is between begin() and commit()
+ * txn (long) - number of the last commit this process has seen
+ * free_list (long) - address of the newest free list chunk of that commit, -1 if there is none
+ * list_count (long) - number of chunks in use, from the newest one back
+ * consumed (long) - entries of the oldest chunk in use that have been reused
+ * loaded_txn (long) - commit whose free list free_pages and list_chunks hold
+ * free_pages (deque<pair<long, long>>) - free blocks and the commit that freed each, oldest first
+ * list_chunks (deque<pair<long, int>>) - the chunks in use and their entry counts, oldest first
+ * fresh (unordered_set<long>) - blocks written since begin(), which are changed in place
+ * freed (vector<long>) - committed blocks the open transaction replaced
+ * horizon (long) - oldest transaction a reader may still be on, found by begin()
+ * records (char[2][record_size]) - both commit records as last read or written
+ * table (Reader *) - the mapped reader slots, NULL if they couldn't be mapped
+ * own_slot (int) - slot of this process in 'table', -1 if it has none
+ * snapshots (map<long, int>) - transactions the threads of this process read, and how many read each
+ * reused, appended (long) - statistics reported by print_stats()
+ */
+class ShadowPaging
+{
+    public:
+    struct Reader
+    {
+        atomic<long> pid;
+        atomic<long> txn;
+    };
+
+    bool active;
+    bool open;
+    long txn;
+    long free_list;
+    long list_count;
+    long consumed;
+    long loaded_txn;
+    deque<pair<long, long> > free_pages;
+    deque<pair<long, int> > list_chunks;
+    unordered_set<long> fresh;
+    vector<long> freed;
+    long horizon;
+    static const int record_size = 48;
+    char records[2][record_size];
+    Reader *table;
+    int own_slot;
+    mutex snapshot_mutex;
+    map<long, int> snapshots;
+    long reused;
+    long appended;
+
+    static const int reader_slots = 256;
+    static const int list_header = 12;
+
+    ShadowPaging()
+    {
+        active = open = false;
+        txn = horizon = 0;
+        free_list = -1;
+        list_count = consumed = loaded_txn = 0;
+        memset(records, 0, sizeof(records));
+        table = NULL;
+        own_slot = -1;
+        reused = appended = 0;
+    }
+
+    ~ShadowPaging()
+    {
+        if (own_slot >= 0)
+            table[own_slot].pid = 0;
+    }
+
+    static string table_name(const string &index_file)
+    {
+        return index_file + ".readers";
+    }
+
+    /* offset of commit record 's' (0 or 1) in the metadata block */
+    static long record_offset(int s)
+    {
+        return (s + 1) * (metadata_size / 2) - record_size;
+    }
+
+    /* the newest valid commit record in a metadata block
+     *
+     * output (long int) - its transaction number (0 if neither record is valid), with its fields
+     *                     (see the record layout) in 'fields'
+     */
+    static long latest_record(const char *metadata, long *fields)
+    {
+        long latest = 0;
+        for (int s = 0 ; s < 2 ; s++)
+        {
+            long record[record_size / sizeof(long)];
+            memcpy(record, metadata + record_offset(s), sizeof(record));
+            if (record[0] > latest && fnv1a((const char*) record, 5 * sizeof(long)) == (unsigned long) record[5])
+            {
+                latest = record[0];
+                memcpy(fields, record, sizeof(record));
+            }
+        }
+        return latest;
+    }
+
+    /* make the tree rooted at root_address, just built by -create, the first commit */
+    void start()
+    {
+        active = true;
+        free_list = -1;
+        list_count = consumed = 0;
+        free_pages.clear();
+        list_chunks.clear();
+        txn = loaded_txn = 1;
+        write_record(txn);
+    }
+
+    /* read the commit records of the index being opened and register this process as a reader
+     *
+     * input parameters:
+     * metadata (const char *) - the metadata block as read by initialize_bplus_tree()
+     */
+    void attach(const char *metadata)
+    {
+        active = open = false;
+        if (!adopt(metadata)) // not copy-on-write, or the tree is still being created
+            return;
+        active = true;
+        loaded_txn = 0; // read by the first begin()
+        join_table();
+
+        // a writer that looked at the slots before this one was filled may reuse what the commits up to
+        // the current one freed, so the records are read again until no commit came in between
+        while (own_slot >= 0)
+        {
+            long seen = txn;
+            publish();
+            char buffer[metadata_size];
+            index_device.read_at(0, buffer, metadata_size);
+            adopt(buffer);
+            if (txn == seen)
+                break;
+        }
+
+        if (wal.active)
+        {
+            cout << "A copy-on-write index commits without the redo log, ignoring -wal\n";
+            wal.active = false;
+        }
+    }
+
+    /* take in what other processes committed since this one last looked, dropping its cached blocks */
+    void refresh()
+    {
+        if (!active || open)
+            return;
+        char buffer[metadata_size];
+        index_device.read_at(0, buffer, metadata_size);
+        long fields[record_size / sizeof(long)] = {0};
+        if (latest_record(buffer, fields) == txn)
+            return;
+        lock_guard<mutex> guard(snapshot_mutex);
+        buffer_pool.discard();
+        adopt(buffer);
+        publish();
+    }
+
+    /* start a transaction: wait for other writers, then catch up with their commits */
+    void begin()
+    {
+        if (!active || open)
+            return;
+        if (flock(index_device.fd, LOCK_EX) != 0)
+        {
+            cout << "Cannot lock index file " << index_filename << ": " << strerror(errno) << "\n";
+            exit(1);
+        }
+        refresh();
+        open = true;
+        index_device.reload_end();
+        data_device.reload_end();
+        if (loaded_txn != txn)
+            load_free_list();
+        horizon = oldest_reader();
+    }
+
+    /* a block for a new node: a free one no reader can reach, else one at the end of the file */
+    long allocate()
+    {
+        long address;
+        if (!free_pages.empty() && free_pages.front().second <= horizon)
+        {
+            address = free_pages.front().first;
+            free_pages.pop_front();
+            if (++consumed == list_chunks.front().second) // the oldest chunk is used up
+            {
+                freed.push_back(list_chunks.front().first);
+                list_chunks.pop_front();
+                consumed = 0;
+            }
+            reused++;
+        }
+        else
+        {
+            address = buffer_pool.allocate();
+            appended++;
+        }
+        fresh.insert(address);
+        return address;
+    }
+
+    /* the block a node read from 'address' is written to: the same one if this transaction wrote it */
+    long relocate(long address)
+    {
+        if (fresh.count(address) > 0)
+            return address;
+        freed.push_back(address);
+        return allocate();
+    }
+
+    /* make everything written since begin() durable and visible as one commit, and let other writers in
+     *
+     * input parameters:
+     * metadata_changed (bool) - commit even if no block was written, for the other metadata fields
+     */
+    void commit(bool metadata_changed = false)
+    {
+        if (!open)
+            return;
+        if (metadata_changed || !fresh.empty() || !freed.empty())
+        {
+            long next = txn + 1;
+            write_free_list(next);
+            buffer_pool.flush();
+            data_device.sync();
+            index_device.sync(); // the new tree is on disk before the record pointing at it
+            write_record(next);
+            open = false;
+            update_metadata();
+            index_device.sync();
+
+            lock_guard<mutex> guard(snapshot_mutex);
+            txn = loaded_txn = next;
+            publish();
+        }
+        open = false;
+        fresh.clear();
+        flock(index_device.fd, LOCK_UN);
+    }
+
+    /* register a reader thread on the last commit
+     *
+     * output (long int) - the transaction it reads, to be passed to leave(); -1 for other indexes
+     */
+    long enter()
+    {
+        if (!active)
+            return -1;
+        lock_guard<mutex> guard(snapshot_mutex);
+        snapshots[txn]++;
+        publish();
+        return txn;
+    }
+
+    void leave(long reader_txn)
+    {
+        if (reader_txn == -1)
+            return;
+        lock_guard<mutex> guard(snapshot_mutex);
+        if (--snapshots[reader_txn] == 0)
+            snapshots.erase(reader_txn);
+        publish();
+    }
+
+    void print_stats()
+    {
+        cout << "Shadow paging: commit " << txn << ", " << reused << " freed blocks reused, " << appended
+             << " blocks appended, " << free_pages.size() << " blocks on the free list in " << list_chunks.size()
+             << " chunks\n";
+    }
+
+    private:
+    /* take the newest commit record of a metadata block as the current commit
+     *
+     * output (bool) - false if neither record is valid
+     */
+    bool adopt(const char *metadata)
+    {
+        long fields[record_size / sizeof(long)] = {0};
+        long latest = latest_record(metadata, fields);
+        if (latest == 0)
+            return false;
+        for (int s = 0 ; s < 2 ; s++)
+            memcpy(records[s], metadata + record_offset(s), record_size);
+        txn = latest;
+        root_address = fields[1];
+        free_list = fields[2];
+        list_count = fields[3];
+        consumed = fields[4];
+        return true;
+    }
+
+    /* fill in the commit record of transaction 't' (written with the metadata by update_metadata()) */
+    void write_record(long t)
+    {
+        long fields[record_size / sizeof(long)] = { t, root_address, free_list, list_count, consumed, 0 };
+        fields[5] = fnv1a((const char*) fields, 5 * sizeof(long));
+        memcpy(records[t % 2], fields, sizeof(fields));
+    }
+
+    /* map <index file>.readers and claim a slot that is empty or left by a process that is gone */
+    void join_table()
+    {
+        if (table != NULL)
+            return;
+        string name = table_name(index_filename);
+        long size = reader_slots * sizeof(Reader);
+        int fd = ::open(name.c_str(), O_RDWR | O_CREAT, 0644);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && (st.st_size >= size || ftruncate(fd, size) == 0))
+        {
+            void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED)
+                table = (Reader*) p;
+        }
+        if (fd >= 0)
+            ::close(fd);
+        if (table == NULL)
+        {
+            cout << "Cannot map reader table " << name << ", freed blocks won't be reused\n";
+            return;
+        }
+
+        long me = getpid();
+        for (int s = 0 ; s < reader_slots && own_slot < 0 ; s++)
+        {
+            long pid = table[s].pid;
+            if ((pid == 0 || !alive(pid)) && table[s].pid.compare_exchange_strong(pid, me))
+                own_slot = s;
+        }
+        if (own_slot < 0)
+            cout << "All " << reader_slots << " reader slots of " << name << " are taken, freed blocks won't be reused\n";
+    }
+
+    static bool alive(long pid)
+    {
+        return kill(pid, 0) == 0 || errno != ESRCH;
+    }
+
+    /* record the oldest transaction this process reads in its slot (snapshot_mutex held) */
+    void publish()
+    {
+        if (own_slot >= 0)
+            table[own_slot].txn = snapshots.empty() ? txn : min(txn, snapshots.begin()->first);
+    }
+
+    /* the oldest transaction any reader is on, clearing the slots of processes that are gone */
+    long oldest_reader()
+    {
+        if (own_slot < 0) // readers this process can't see may be on any commit
+            return 0;
+        long oldest = txn;
+        {
+            lock_guard<mutex> guard(snapshot_mutex);
+            if (!snapshots.empty())
+                oldest = min(oldest, snapshots.begin()->first);
+        }
+        for (int s = 0 ; s < reader_slots ; s++)
+        {
+            long pid = table[s].pid;
+            if (s == own_slot || pid == 0)
+                continue;
+            if (!alive(pid))
+                table[s].pid.compare_exchange_strong(pid, 0);
+            else
+                oldest = min(oldest, table[s].txn.load());
+        }
+        return oldest;
+    }
+
+    /* read the chunks of the free list of the current commit into free_pages and list_chunks */
+    void load_free_list()
+    {
+        vector<vector<pair<long, long> > > entries; // of every chunk, newest first
+        list_chunks.clear();
+        long address = free_list;
+        for (long c = 0 ; c < list_count ; c++)
+        {
+            const char *data = buffer_pool.pin(address);
+            long older;
+            int count;
+            memcpy(&older, data, sizeof(older));
+            memcpy(&count, data + sizeof(older), sizeof(count));
+            entries.push_back(vector<pair<long, long> >());
+            for (int i = 0 ; i < count ; i++)
+            {
+                long entry[2];
+                memcpy(entry, data + list_header + i * sizeof(entry), sizeof(entry));
+                entries.back().push_back(make_pair(entry[0], entry[1]));
+            }
+            buffer_pool.unpin(address, false);
+            list_chunks.push_front(make_pair(address, count));
+            address = older;
+        }
+
+        free_pages.clear();
+        for (long c = entries.size() - 1 ; c >= 0 ; c--)
+            free_pages.insert(free_pages.end(), entries[c].begin() + (c == (long) entries.size() - 1 ? consumed : 0), entries[c].end());
+        loaded_txn = txn;
+    }
+
+    /* append the blocks commit 'next' freed to the free list as new chunks (one unless there are many) */
+    void write_free_list(long next)
+    {
+        // the chunks are allocated first, since taking a block off the list may use up the oldest chunk
+        // and free its block as well
+        long per_chunk = (block_size - list_header) / (2 * sizeof(long));
+        vector<long> chunks;
+        while ((long) chunks.size() * per_chunk < (long) freed.size())
+            chunks.push_back(allocate());
+
+        size_t e = 0;
+        for (long chunk : chunks)
+        {
+            char *data = buffer_pool.pin(chunk, false);
+            int count = min((size_t) per_chunk, freed.size() - e);
+            memcpy(data, &free_list, sizeof(free_list));
+            memcpy(data + sizeof(free_list), &count, sizeof(count));
+            for (int i = 0 ; i < count ; i++, e++)
+            {
+                long entry[2] = { freed[e], next };
+                memcpy(data + list_header + i * sizeof(entry), entry, sizeof(entry));
+                free_pages.push_back(make_pair(freed[e], next));
+            }
+            buffer_pool.unpin(chunk, true);
+            list_chunks.push_back(make_pair(chunk, count));
+            free_list = chunk;
+        }
+        freed.clear();
+        list_count = list_chunks.size();
+    }
+};
+
+// copy-on-write state of the open index
+ShadowPaging shadow;
+
+/* class keeping the tree of the last commit of a copy-on-write index from being reused while a
+ * reader thread is in it (nothing to do for other indexes)
+ */
+class Snapshot
+{
+    public:
+    long txn;
+
+    Snapshot()
+    {
+        txn = shadow.enter();
+    }
+
+    ~Snapshot()
+    {
+        shadow.leave(txn);
+    }
+};
+
+/* signature for stage_inner_node function (see InnerLevels) */
+void stage_inner_node(long address, const vector<string> &keys, const vector<long> &children);
+
+/* class representing a B+ tree node 
+ *
+ * member variables:
+ * address (long) - stores the offset in the index file where this node is written (-1 when not written)
+ * is_leaf (boolean) - flag representing whether this is a leaf node or internal node
+ * keys (vector<string>) - list of strings representing keys stored by this internal/leaf node
+ * children (vector<long>) - list of offsets representing pointers to children nodes stored by this internal node
+ * pointers (vector<long>) - list of offsets representing pointers to file offsets stored by this leaf node
+ * next (long) - offset representing pointer to next sibling node for this leaf (-1 for internal or uninitialized nodes)
+ * prev (long) - offset representing pointer to prev sibling node for this leaf (-1 for internal or uninitialized nodes)
+
+ */
+class Node
+{
+    public:
+    long address;
+    bool is_leaf;
+    vector<string> keys;
+    vector<long> children;
+    vector<long> pointers;
+    vector<string> payloads; // leaves of a covering index: encoded payload of each entry
+    vector<long> counts; // format 3 internal nodes: number of leaf entries below each child
+    long next; // address of next block
+    long prev; // address of prev block
+
+    /* read the Node from a specific address */
+    Node(long addr)
+    {
+        address = addr;
+        read_from_disk();
+    }
+
+    /* constructor for node with a single value */
+    Node(bool leaf, string key, long val, long ptr)
+    {
+        is_leaf = leaf;
+        next = -1;
+        prev = -1;
+        address = -1;
+
+        keys.push_back(key);
+
+        if (leaf)
+            pointers.push_back(val);
+        else
+            children.push_back(ptr);
+    }
+
+    /* constructor for nodes with multiple values */
+    Node(bool leaf, vector<string> keys_, vector<long> vals, vector<long> ptrs)
+    {
+        is_leaf = leaf;
+        next = -1;
+        prev = -1;
+        address = -1;
+
+        keys = keys_;
+
+        if (leaf)
+            pointers = vals;
+        else
+            children = ptrs;
+    }
+
+    /* write a Node object into its block in the buffer pool at the specified 'address'. Written either at
+     * 1.'address' if exists already then overwrite that block for block_size
+     * 2. append to end of file
+     * a copy-on-write index moves the node to a block no commit uses instead (see ShadowPaging), which
+     * changes 'address'
+     */
+    void write_to_disk()
+    {
+        if (address == -1)
+            address = shadow.active ? shadow.allocate() : buffer_pool.allocate(); // append to the end of the file
+        else if (shadow.active)
+            address = shadow.relocate(address);
+
+        char *buffer = buffer_pool.pin(address, false);
+        if (format_version == 1)
+            write_v1(buffer);
+        else
+            write_v2(buffer);
+        buffer_pool.unpin(address, true); // written back to the file when evicted or flushed
+        if (!is_leaf)
+            stage_inner_node(address, keys, children);
+
+        flush_node();
+    }
+
+    /* number of bytes this node takes up in its block */
+    long encoded_size()
+    {
+        long values = is_leaf ? pointers.size() : children.size();
+        if (format_version == 1)
+            return sizeof(bool) + 3 * sizeof(long) + keys.size() * (key_len + 1) + values * sizeof(long);
+
+        int prefix_len, width;
+        key_layout(prefix_len, width);
+        long size = v2_header_size + prefix_len + values * sizeof(long);
+        if (packs_pointers())
+        {
+            long base;
+            size += packed_pointers_size(values, pointer_width(pointers, base)) - values * sizeof(long);
+        }
+        if (has_counts())
+            size += values * sizeof(long);
+        if (width == v2_variable)
+        {
+            size += 2 * (keys.size() + 1); // slot directory
+            for (const string &key : keys)
+                size += key.length() - prefix_len;
+        }
+        else
+            size += keys.size() * width;
+
+        if (is_leaf && cover_len != 0)
+        {
+            size += 2 * (payloads.size() + 1); // payload slot directory
+            for (const string &payload : payloads)
+                size += payload.length();
+        }
+        return size;
+    }
+
+    /* whether the node stores its data file pointers bit packed (format 3 leaves) */
+    bool packs_pointers()
+    {
+        return is_leaf && format_version == 3;
+    }
+
+    /* whether the node records the number of entries below each child (format 3 internal nodes) */
+    bool has_counts()
+    {
+        return !is_leaf && format_version == 3;
+    }
+
+    /* number of leaf entries in the subtree rooted at this node */
+    long entries()
+    {
+        if (is_leaf)
+            return keys.size();
+        long total = 0;
+        for (long c : counts)
+            total += c;
+        return total;
+    }
+
+    /* format 2 key layout: length of the prefix shared by all keys and the width of every suffix
+     * (v2_variable when the suffixes are not all the same length)
+     */
+    void key_layout(int &prefix_len, int &width)
+    {
+        prefix_len = 0;
+        width = 0;
+        if (keys.empty())
+            return;
+
+        // keys are sorted, so the first and last key share the prefix common to all of them
+        prefix_len = common_prefix(keys.front(), keys.back());
+        width = keys[0].length() - prefix_len;
+        for (const string &key : keys)
+        {
+            if ((int) key.length() - prefix_len != width)
+            {
+                width = v2_variable;
+                break;
+            }
+        }
+    }
+
+    /* fixed-size key layout: is_leaf, next, prev, number of keys, keys (key_len + 1 bytes), values */
+    void write_v1(char *buffer)
+    {
+        long offset = 0;
+
+        // write is_leaf bool
+        memcpy(buffer + offset, &is_leaf, sizeof(is_leaf));
+        offset += sizeof(is_leaf);
+
+        // write next pointer
+        memcpy(buffer + offset, &next, sizeof(next));
+        offset += sizeof(next);
+
+        // write prev pointer
+        memcpy(buffer + offset, &prev, sizeof(prev));
+        offset += sizeof(prev);
+
+        // write number of keys in this node
+        long keys_size = keys.size();
+        memcpy(buffer + offset, &keys_size, sizeof(keys_size));
+        offset += sizeof(keys_size);
+
+        // write keys
+        for (string key : keys) 
+        {
+            memcpy(buffer + offset, key.c_str(), strlen(key.c_str()) + 1);
+            offset += strlen(key.c_str()) + 1;
+        }
+
+        // Add the child pointers to memory
+        if (is_leaf == false) // internal node - write long children 
+        {
+            for (long child : children) 
+            {
+                memcpy(buffer + offset, &child, sizeof(child));
+                offset += sizeof(child);
+            }
+        } 
+        else  // leaf node - write long pointers
+        {
+            for (long ptr : pointers) 
+            {
+                memcpy(buffer + offset, &ptr, sizeof(ptr));
+                offset += sizeof(ptr);
+            }
+        }
+    }
+
+    /* prefix-compressed layout (see v2_header_size) */
+    void write_v2(char *buffer)
+    {
+        int prefix_len, width;
+        key_layout(prefix_len, width);
+        if (encoded_size() > block_size)
+        {
+            cout << "Node at " << address << " does not fit in a " << block_size << " byte block\n";
+            exit(1);
+        }
+        if (has_counts() && counts.size() != children.size())
+        {
+            cout << "Node at " << address << " is missing the entry counts of its children\n";
+            exit(1);
+        }
+
+        unsigned short count = keys.size(), prefix = prefix_len, suffix_width = width;
+        buffer[0] = is_leaf;
+        memcpy(buffer + 1, &next, sizeof(next));
+        memcpy(buffer + 9, &prev, sizeof(prev));
+        memcpy(buffer + 17, &count, sizeof(count));
+        memcpy(buffer + 19, &prefix, sizeof(prefix));
+        memcpy(buffer + 21, &suffix_width, sizeof(suffix_width));
+
+        long offset = v2_header_size;
+        if (count > 0)
+            memcpy(buffer + offset, keys[0].data(), prefix_len);
+        offset += prefix_len;
+
+        if (width != v2_variable)
+        {
+            for (const string &key : keys)
+            {
+                memcpy(buffer + offset, key.data() + prefix_len, width);
+                offset += width;
+            }
+        }
+        else
+        {
+            // slot i holds the start of suffix i relative to the suffix bytes, slot count holds their end
+            long slots = offset;
+            offset += 2 * (count + 1);
+            unsigned short pos = 0;
+            for (int i = 0 ; i < count ; i++)
+            {
+                memcpy(buffer + slots + 2 * i, &pos, sizeof(pos));
+                memcpy(buffer + offset + pos, keys[i].data() + prefix_len, keys[i].length() - prefix_len);
+                pos += keys[i].length() - prefix_len;
+            }
+            memcpy(buffer + slots + 2 * count, &pos, sizeof(pos));
+            offset += pos;
+        }
+
+        vector<long> &values = is_leaf ? pointers : children;
+        if (packs_pointers())
+        {
+            pack_pointers(pointers, buffer + offset);
+            long base;
+            offset += packed_pointers_size(count, pointer_width(pointers, base));
+        }
+        else
+        {
+            memcpy(buffer + offset, values.data(), values.size() * sizeof(long));
+            offset += values.size() * sizeof(long);
+        }
+        if (has_counts())
+            memcpy(buffer + offset, counts.data(), counts.size() * sizeof(long));
+
+        if (is_leaf && cover_len != 0)
+        {
+            long slots = offset;
+            offset += 2 * (count + 1);
+            unsigned short pos = 0;
+            for (int i = 0 ; i < count ; i++)
+            {
+                memcpy(buffer + slots + 2 * i, &pos, sizeof(pos));
+                memcpy(buffer + offset + pos, payloads[i].data(), payloads[i].length());
+                pos += payloads[i].length();
+            }
+            memcpy(buffer + slots + 2 * count, &pos, sizeof(pos));
+        }
+    }
+
+    /* delete the current Node from memory */
+    void flush_node()
+    {
+        is_leaf = false;
+        next = -1;
+        prev = -1;
+        keys.clear();
+        children.clear();
+        pointers.clear();
+        payloads.clear();
+        counts.clear();
+    }
+
+    /* read Node object from index file at 'address' (through the buffer pool) */
+    void read_from_disk()
+    {
+        if (address <= 0) // block hasn't been written to disk yet, can't read it
+            return;
+
+        char *buf = buffer_pool.pin(address);
+        if (format_version == 1)
+            read_v1(buf);
+        else
+            read_v2(buf);
+        buffer_pool.unpin(address, false);
+    }
+
+    void read_v1(char *buf)
+    {
+        long offset = 0;
+
+        // read is_leaf bool 
+        memcpy(&is_leaf, buf + offset, sizeof(bool));
+        offset += sizeof(is_leaf);
+
+        // read next addr pointer
+        memcpy(&next, buf + offset, sizeof(long));
+        offset += sizeof(long);
+
+        // read prev addr pointer
+        memcpy(&prev, buf + offset, sizeof(long));
+        offset += sizeof(long);
+
+        // read the number of keys stored
+        long keys_size;
+        memcpy(&keys_size, buf + offset, sizeof(keys_size));
+        offset += sizeof(keys_size);
+
+        // read the keys
+        keys.clear();
+        for (int i = 0 ; i < keys_size ; i++) 
+        {
+            string key(buf + offset, key_len); // keylen
+            offset += key_len + 1; // keylen + 1 to account for '\0' character
+            keys.push_back(key);
+        }
+
+        if (is_leaf == false) // internal node - read children 
+        {
+            children.clear();
             for (int i = 0 ; i < keys_size + 1 ; i++) 
             {
-                long child;
-                memcpy(&child, buf + offset, sizeof(child));
-                offset += sizeof(child);
-                children.push_back(child);
+                long child;
+                memcpy(&child, buf + offset, sizeof(child));
+                offset += sizeof(child);
+                children.push_back(child);
+            }
+        } 
+        else // leaf node - read pointers
+        {
+            pointers.clear();
+            for (long i = 0 ; i < keys_size ; i++) 
+            {
+                long pointer;
+                memcpy(&pointer, buf + offset, sizeof(pointer));
+                offset += sizeof(pointer);
+                pointers.push_back(pointer);
+            }
+        }
+    }
+
+    void read_v2(char *buf)
+    {
+        unsigned short count, prefix_len, width;
+        is_leaf = buf[0] != 0;
+        memcpy(&next, buf + 1, sizeof(next));
+        memcpy(&prev, buf + 9, sizeof(prev));
+        memcpy(&count, buf + 17, sizeof(count));
+        memcpy(&prefix_len, buf + 19, sizeof(prefix_len));
+        memcpy(&width, buf + 21, sizeof(width));
+
+        long offset = v2_header_size;
+        string prefix(buf + offset, prefix_len);
+        offset += prefix_len;
+
+        keys.clear();
+        if (width != v2_variable)
+        {
+            for (int i = 0 ; i < count ; i++)
+            {
+                keys.push_back(prefix + string(buf + offset, width));
+                offset += width;
+            }
+        }
+        else
+        {
+            long slots = offset;
+            offset += 2 * (count + 1);
+            for (int i = 0 ; i < count ; i++)
+            {
+                unsigned short start, end;
+                memcpy(&start, buf + slots + 2 * i, sizeof(start));
+                memcpy(&end, buf + slots + 2 * (i + 1), sizeof(end));
+                keys.push_back(prefix + string(buf + offset + start, end - start));
+            }
+            unsigned short heap_size;
+            memcpy(&heap_size, buf + slots + 2 * count, sizeof(heap_size));
+            offset += heap_size;
+        }
+
+        vector<long> &values = is_leaf ? pointers : children;
+        values.resize(is_leaf ? count : count + 1);
+        (is_leaf ? children : pointers).clear();
+        if (packs_pointers())
+        {
+            unpack_pointers(buf + offset, count, values.data());
+            offset += packed_pointers_size(count, (unsigned char) buf[offset + 8]);
+        }
+        else
+        {
+            memcpy(values.data(), buf + offset, values.size() * sizeof(long));
+            offset += values.size() * sizeof(long);
+        }
+        counts.clear();
+        if (has_counts())
+        {
+            counts.resize(count + 1);
+            memcpy(counts.data(), buf + offset, counts.size() * sizeof(long));
+        }
+
+        payloads.clear();
+        if (is_leaf && cover_len != 0)
+        {
+            long slots = offset;
+            offset += 2 * (count + 1);
+            for (int i = 0 ; i < count ; i++)
+            {
+                unsigned short start, end;
+                memcpy(&start, buf + slots + 2 * i, sizeof(start));
+                memcpy(&end, buf + slots + 2 * (i + 1), sizeof(end));
+                payloads.push_back(string(buf + offset + start, end - start));
+            }
+        }
+    }
+
+    /* bring the ith child of an internal node into memory 
+     * 
+     * input parameters:
+     * idx (int) - position of the child to bring into memory
+     * 
+     * output (unique_ptr<Node>) - the ith child now brought into memory, owned by the caller
+     */
+    unique_ptr<Node> get_child(int idx)
+    {
+        return unique_ptr<Node>(new Node(children[idx]));
+    }
+};
+
+/* compares 'key' (of any length) against a stored key of 'width' bytes, like string::compare */
+int compare_key(const char *key, long len, const char *stored, long width)
+{
+    int c = memcmp(key, stored, min(len, width));
+    if (c != 0)
+        return c;
+    return len < width ? -1 : (len > width ? 1 : 0);
+}
+
+#if defined(__x86_64__)
+/* compare_key() for width <= 16 with one SSE2 byte compare: the first differing byte decides
+ * both 'key' and 'stored' must be readable for 16 bytes (see search_keys())
+ */
+int compare_key_sse2(const char *key, long len, const char *stored, long width)
+{
+    __m128i a = _mm_loadu_si128((const __m128i*) key);
+    __m128i b = _mm_loadu_si128((const __m128i*) stored);
+    unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & ((1u << min(len, width)) - 1);
+    if (diff != 0)
+    {
+        int i = __builtin_ctz(diff);
+        return (unsigned char) key[i] < (unsigned char) stored[i] ? -1 : 1;
+    }
+    return len < width ? -1 : (len > width ? 1 : 0);
+}
+
+/* compare_key() for width <= 32 with one AVX2 byte compare */
+__attribute__((target("avx2")))
+int compare_key_avx2(const char *key, long len, const char *stored, long width)
+{
+    __m256i a = _mm256_loadu_si256((const __m256i*) key);
+    __m256i b = _mm256_loadu_si256((const __m256i*) stored);
+    unsigned diff = ~(unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)) & (unsigned) ((1UL << min(len, width)) - 1);
+    if (diff != 0)
+    {
+        int i = __builtin_ctz(diff);
+        return (unsigned char) key[i] < (unsigned char) stored[i] ? -1 : 1;
+    }
+    return len < width ? -1 : (len > width ? 1 : 0);
+}
+#endif
+
+// once the binary search narrows to this many keys, the rest are compared one by one
+const int search_tail = 8;
+
+/* the first N (1 to 8) bytes at p as a big-endian integer, so integers order like memcmp() of the bytes */
+template <int N>
+inline unsigned long load_be(const char *p)
+{
+    unsigned long v = 0;
+    memcpy(&v, p, N);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(v);
+#else
+    return v;
+#endif
+}
+
+/* search kernel for stored keys exactly W bytes wide, W known at compile time
+ *
+ * The search key is packed once into big-endian words (an array of (W + 7) / 8 integers, zero padded),
+ * so each compare is a fixed number of integer loads and compares the compiler unrolls, and no bytes
+ * past a stored key are read. A search key of another length than W compares like compare_key(): the
+ * first min(len, W) bytes decide, then the shorter key is the smaller.
+ */
+template <int W>
+class FixedWidthSearch
+{
+    public:
+    static const int words = (W + 7) / 8;
+
+    /* search_keys() for width W */
+    static int search(const char *base, long stride, long count, const char *key, long len, bool upper)
+    {
+        array<unsigned long, words> probe;
+        char padded[words * 8];
+        memset(padded, 0, sizeof(padded));
+        memcpy(padded, key, min(len, (long) W));
+        for (int i = 0 ; i < words ; i++)
+            probe[i] = load_be<8>(padded + 8 * i);
+        int tie = len < W ? -1 : (len > W ? 1 : 0);
+
+        long first = 0;
+        long n = count;
+        while (n > search_tail)
+        {
+            long half = n / 2;
+            int c = compare(probe, tie, base + (first + half - 1) * stride);
+            first += (upper ? c >= 0 : c > 0) ? half : 0;
+            n -= half;
+        }
+        long tail = 0;
+        for (long i = 0 ; i < n ; i++)
+        {
+            int c = compare(probe, tie, base + (first + i) * stride);
+            tail += upper ? c >= 0 : c > 0;
+        }
+        return first + tail;
+    }
+
+    private:
+    static int compare(const array<unsigned long, words> &probe, int tie, const char *stored)
+    {
+        for (int i = 0 ; i < words ; i++)
+        {
+            unsigned long s = i + 1 < words ? load_be<8>(stored + 8 * i) : load_be<W - 8 * (words - 1)>(stored + 8 * i);
+            if (probe[i] != s)
+                return probe[i] < s ? -1 : 1;
+        }
+        return tie;
+    }
+};
+
+// keys up to this wide are searched by a FixedWidthSearch instantiation, wider ones by the generic kernels
+const int max_fixed_width = 32;
+
+typedef int (*fixed_search_fn)(const char*, long, long, const char*, long, bool);
+
+template <size_t... W>
+array<fixed_search_fn, sizeof...(W)> make_fixed_searches(index_sequence<W...>)
+{
+    return {{ FixedWidthSearch<W + 1>::search... }};
+}
+
+// FixedWidthSearch<w>::search for every width w from 1 to max_fixed_width, at index w - 1
+const array<fixed_search_fn, max_fixed_width> fixed_searches = make_fixed_searches(make_index_sequence<max_fixed_width>());
+
+// the instantiation for key_len, chosen by select_search_kernel() when the index is opened (NULL if
+// key_len is wider than max_fixed_width or -search simd is used): format 1 nodes always hold keys of
+// exactly this width
+fixed_search_fn key_len_search = NULL;
+
+/* detect the CPU features the AVX2 kernels depend on and pick the search kernel for key_len
+ * (called when an index is opened)
+ */
+void select_search_kernel()
+{
+#if defined(__x86_64__)
+    cpu_has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+    key_len_search = key_len >= 1 && key_len <= max_fixed_width && !use_simd_search ? fixed_searches[key_len - 1] : NULL;
+}
+
+/* search a sorted array of fixed-width keys
+ *
+ * Keys up to max_fixed_width bytes wide go to the FixedWidthSearch instantiation for their width.
+ * With -search simd they are compared instead by one SSE2 compare per key for widths up to 16 bytes
+ * and one AVX2 compare for widths up to 32 bytes when the CPU has it. Wider keys, and keys too close
+ * to 'limit' for the SIMD loads, use the same search with memcmp: a branch-free binary search (the
+ * range is halved with a conditional add rather than a branch) until search_tail keys are left, then
+ * the remaining keys are counted one by one.
+ *
+ * input parameters:
+ * base (const char *) - the first stored key
+ * stride (long) - distance in bytes between consecutive keys
+ * count (long) - number of keys
+ * key (const char *) - the search key, len bytes long
+ * width (long) - length of every stored key
+ * upper (bool) - true: first key larger than 'key'; false: first key equal to or larger than 'key'
+ * limit (const char *) - end of the block holding the keys, which the SIMD loads must not cross
+ *
+ * output (int) - the position found, in [0, count]
+ */
+int search_keys(const char *base, long stride, long count, const char *key, long len, long width, bool upper,
+                const char *limit)
+{
+    if (width >= 1 && width <= max_fixed_width && !use_simd_search)
+        return fixed_searches[width - 1](base, stride, count, key, len, upper);
+
+    int (*compare)(const char*, long, const char*, long) = compare_key;
+    long simd_bytes = 0;
+#if defined(__x86_64__)
+    if (use_simd_search && width <= 16)
+    {
+        compare = compare_key_sse2;
+        simd_bytes = 16;
+    }
+    else if (use_simd_search && width <= 32 && cpu_has_avx2)
+    {
+        compare = compare_key_avx2;
+        simd_bytes = 32;
+    }
+#endif
+
+    // the SIMD kernels load a full 16/32 bytes of both keys, so a short search key is zero-padded
+    char probe[32];
+    if (simd_bytes > 0 && count > 0 && base + (count - 1) * stride + simd_bytes <= limit)
+    {
+        if (len < simd_bytes)
+        {
+            memset(probe, 0, simd_bytes);
+            memcpy(probe, key, len);
+            key = probe;
+        }
+    }
+    else if (width >= 1 && width <= max_fixed_width)
+        return fixed_searches[width - 1](base, stride, count, key, len, upper);
+
+    long first = 0;
+    long n = count;
+    while (n > search_tail)
+    {
+        long half = n / 2;
+        int c = compare(key, len, base + (first + half - 1) * stride, width);
+        first += (upper ? c >= 0 : c > 0) ? half : 0;
+        n -= half;
+    }
+    long tail = 0;
+    for (long i = 0 ; i < n ; i++)
+    {
+        int c = compare(key, len, base + (first + i) * stride, width);
+        tail += upper ? c >= 0 : c > 0;
+    }
+    return first + tail;
+}
+
+/* the first min(width, 8) bytes of a key as a big-endian integer (the integer keys' leading bytes) */
+unsigned long key_head(const char *key, long width)
+{
+    unsigned long h = 0;
+    for (long i = 0 ; i < min(width, 8L) ; i++)
+        h = (h << 8) | (unsigned char) key[i];
+    return h;
+}
+
+/* search a sorted array of fixed-width integer keys (integer key mode) by interpolation
+ *
+ * The position is first estimated from where the key's leading bytes fall between those of the first
+ * and last keys, then a bracket around the answer is found by galloping out from the estimate, and
+ * the bracket is searched with search_keys(). Small arrays and keys outside the first and last keys
+ * go straight to search_keys().
+ *
+ * input parameters: as for search_keys()
+ *
+ * output (int) - the position found, in [0, count]
+ */
+int interpolation_search(const char *base, long stride, long count, const char *key, long len, long width, bool upper,
+                         const char *limit)
+{
+    if (count <= 4 * search_tail || len != width || width == 0)
+        return search_keys(base, stride, count, key, len, width, upper, limit);
+    unsigned long low = key_head(base, width);
+    unsigned long high = key_head(base + (count - 1) * stride, width);
+    unsigned long k = key_head(key, width);
+    if (k <= low || k >= high)
+        return search_keys(base, stride, count, key, len, width, upper, limit);
+
+    // keys at positions below the answer compare less than 'key' (or equal, for upper)
+    auto below = [&](long i)
+    {
+        int c = memcmp(base + i * stride, key, width);
+        return upper ? c <= 0 : c < 0;
+    };
+
+    long guess = (long) ((long double) (k - low) / (high - low) * (count - 1));
+    long first, last; // the answer is in [first, last]
+    if (below(guess))
+    {
+        first = guess + 1;
+        last = first;
+        for (long step = 1 ; last < count && below(last) ; step *= 2)
+        {
+            first = last + 1;
+            last = min(count, first + step);
+        }
+    }
+    else
+    {
+        last = guess;
+        first = 0;
+        for (long step = 1 ; last - step >= 0 ; step *= 2)
+        {
+            if (below(last - step))
+            {
+                first = last - step + 1;
+                break;
+            }
+            last -= step;
+        }
+    }
+    return first + search_keys(base + first * stride, stride, last - first, key, len, width, upper, limit);
+}
+
+/* position of the first key in a node's keys that is larger than 'key' (the child to descend into) */
+int upper_bound_key(const vector<string> &keys, const string &key)
+{
+    return upper_bound(keys.begin(), keys.end(), key) - keys.begin();
+}
+
+/* class representing a read-only view of a node block, interpreted in place (inside a buffer pool
+ * frame or a mapping) without building a Node
+ *
+ * Mirrors the layouts written by Node::write_v1() and Node::write_v2().
+ */
+class NodeView
+{
+    public:
+    const char *block;
+
+    NodeView(const char *b)
+    {
+        block = b;
+    }
+
+    bool is_leaf() const
+    {
+        return block[0] != 0;
+    }
+
+    long next() const
+    {
+        return read_long(1);
+    }
+
+    long count() const
+    {
+        return format_version == 1 ? read_long(17) : read_short(17);
+    }
+
+    /* position of the child to follow for 'key': the first key larger than it */
+    int upper_bound(const char *key, long len) const
+    {
+        return search(key, len, true);
+    }
+
+    /* position of the first key that is equal to or larger than 'key' */
+    int lower_bound(const char *key, long len) const
+    {
+        return search(key, len, false);
+    }
+
+    /* compares 'key' against the ith key of the node, like string::compare */
+    int compare_at(int i, const char *key, long len) const
+    {
+        if (format_version == 1)
+            return compare_key(key, len, block + v1_header_size + (long) i * (key_len + 1), key_len);
+
+        int prefix_len = read_short(19);
+        int c = memcmp(key, block + v2_header_size, min(len, (long) prefix_len));
+        if (c != 0)
+            return c;
+        if (len < prefix_len)
+            return -1;
+
+        const char *suffixes = block + v2_header_size + prefix_len;
+        int width = read_short(21);
+        if (width != v2_variable)
+            return compare_key(key + prefix_len, len - prefix_len, suffixes + (long) i * width, width);
+
+        int start = read_short(v2_header_size + prefix_len + 2 * i);
+        int end = read_short(v2_header_size + prefix_len + 2 * (i + 1));
+        return compare_key(key + prefix_len, len - prefix_len, suffixes + 2 * (count() + 1) + start, end - start);
+    }
+
+    /* ith child of an internal node, or ith data file pointer of a leaf */
+    long value(int i) const
+    {
+        if (format_version == 3 && is_leaf())
+            return unpack_pointer(block + values_offset(), i);
+        return read_long(values_offset() + (long) i * sizeof(long));
+    }
+
+    /* number of leaf entries below the ith child of a format 3 internal node */
+    long entries(int i) const
+    {
+        return read_long(values_offset() + (count() + 1 + i) * sizeof(long));
+    }
+
+    /* encoded payload of the ith entry of a covering index leaf (see payload_inline)
+     *
+     * output (const char *) - the payload inside the block, 'len' bytes long
+     */
+    const char* payload(int i, long &len) const
+    {
+        long slots = values_offset() + count() * sizeof(long);
+        if (format_version == 3)
+            slots = values_offset() + packed_pointers_size(count(), (unsigned char) block[values_offset() + 8]);
+        int start = read_short(slots + 2 * i);
+        len = read_short(slots + 2 * (i + 1)) - start;
+        return block + slots + 2 * (count() + 1) + start;
+    }
+
+    private:
+    static const int v1_header_size = sizeof(bool) + 3 * sizeof(long);
+
+    int search(const char *key, long len, bool upper) const
+    {
+        long n = count();
+        if (format_version == 1)
+        {
+            if (key_len_search != NULL)
+                return key_len_search(block + v1_header_size, key_len + 1, n, key, len, upper);
+            return search_keys(block + v1_header_size, key_len + 1, n, key, len, key_len, upper, block + block_size);
+        }
+
+        // every key starts with the node's prefix, so comparing against it settles keys outside the node's range
+        int prefix_len = read_short(19);
+        int c = memcmp(key, block + v2_header_size, min(len, (long) prefix_len));
+        if (c < 0 || (c == 0 && len < prefix_len))
+            return 0;
+        if (c > 0)
+            return n;
+
+        const char *suffixes = block + v2_header_size + prefix_len;
+        int width = read_short(21);
+        if (width != v2_variable && int_key_width > 0)
+            return interpolation_search(suffixes, width, n, key + prefix_len, len - prefix_len, width, upper, block + block_size);
+        if (width != v2_variable)
+            return search_keys(suffixes, width, n, key + prefix_len, len - prefix_len, width, upper, block + block_size);
+
+        // variable length suffixes - binary search through the slot directory
+        long first = 0;
+        long last = n;
+        while (first < last)
+        {
+            long mid = (first + last) / 2;
+            int r = compare_at(mid, key, len);
+            if (upper ? r >= 0 : r > 0)
+                first = mid + 1;
+            else
+                last = mid;
+        }
+        return first;
+    }
+
+    long values_offset() const
+    {
+        if (format_version == 1)
+            return v1_header_size + count() * (key_len + 1);
+
+        int prefix_len = read_short(19);
+        int width = read_short(21);
+        if (width != v2_variable)
+            return v2_header_size + prefix_len + count() * width;
+        long slots = v2_header_size + prefix_len;
+        return slots + 2 * (count() + 1) + read_short(slots + 2 * count());
+    }
+
+    long read_long(long offset) const
+    {
+        long v;
+        memcpy(&v, block + offset, sizeof(v));
+        return v;
+    }
+
+    int read_short(long offset) const
+    {
+        unsigned short v;
+        memcpy(&v, block + offset, sizeof(v));
+        return v;
+    }
+};
+
+/* class representing the blocked Bloom filter over the keys of the index, stored in a run of index
+ * file blocks referenced from the metadata block
+ *
+ * Each key hashes to one 64 byte line of the filter and sets bloom_probes bits inside it, so a
+ * lookup touches a single cache line of a single block. A key the filter rejects is certainly not
+ * in the index and needs no tree descent. The filter is sized for the keys of the data file at
+ * -create time (bloom_bits_per_key bits each); inserts set their bits too, so it stays exact about
+ * negatives while its false positive rate slowly rises as the index grows.
+ * Blocks are read and updated through the buffer pool under the frame latches, so filter updates
+ * are logged and checkpointed with the tree.
+ *
+ * member variables:
+ * address (long) - index file address of the first filter block
+ * lines (long) - number of 64 byte lines (0 - the index has no filter)
+ * building (vector<char>) - the bits of a filter being bulk loaded, until end_build() writes them
+ * probes, rejected (atomic<long>) - statistics reported by print_stats()
+ */
+const int bloom_bits_per_key = 10;
+const int bloom_probes = 7;
+const int bloom_line = 64;
+
+class BloomFilter
+{
+    public:
+    long address;
+    long lines;
+    vector<char> building;
+    atomic<long> probes;
+    atomic<long> rejected;
+
+    BloomFilter()
+    {
+        address = lines = 0;
+        probes = rejected = 0;
+    }
+
+    static unsigned long hash(const string &key)
+    {
+        // fnv1a() mixes its last bytes poorly, so finish it with the murmur3 finalizer
+        unsigned long h = fnv1a(key.data(), key.length());
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdUL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53UL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    /* size a new filter for 'keys' keys, whose bits build_add() then sets in memory (bulk loading)
+     *
+     * output (long int) - bytes the filter holds in memory until end_build()
+     */
+    long begin_build(long keys)
+    {
+        long lines_per_block = block_size / bloom_line;
+        long blocks = (max(1L, (keys * bloom_bits_per_key + 8 * bloom_line - 1) / (8 * bloom_line))
+                       + lines_per_block - 1) / lines_per_block;
+        lines = blocks * lines_per_block;
+        building.assign(lines * bloom_line, 0);
+        return building.size();
+    }
+
+    void build_add(const string &key)
+    {
+        unsigned long h = hash(key);
+        set_bits(building.data() + line_of(h) * bloom_line, h);
+    }
+
+    /* write the filter begun by begin_build() in new blocks at the end of the index file */
+    void end_build()
+    {
+        long blocks = building.size() / block_size;
+        address = buffer_pool.allocate(blocks);
+        for (long b = 0 ; b < blocks ; b++)
+        {
+            char *data = buffer_pool.pin(address + b * block_size, false);
+            memcpy(data, building.data() + b * block_size, block_size);
+            buffer_pool.unpin(address + b * block_size, true);
+        }
+        vector<char>().swap(building);
+    }
+
+    /* whether 'key' may be in the index: false means it certainly isn't */
+    bool may_contain(const string &key)
+    {
+        if (lines == 0)
+            return true;
+        unsigned long h = hash(key);
+        long block = block_of(h);
+        const char *data = buffer_pool.latch(block, false);
+        bool found = test_bits(data + line_offset(h), h);
+        buffer_pool.unlatch(block, false, false);
+        return counted(found);
+    }
+
+    /* may_contain() over the index file mapping */
+    bool may_contain_mapped(const char *index, const string &key)
+    {
+        if (lines == 0)
+            return true;
+        unsigned long h = hash(key);
+        return counted(test_bits(index + block_of(h) + line_offset(h), h));
+    }
+
+    /* record a key about to be inserted */
+    void add(const string &key)
+    {
+        if (lines == 0)
+            return;
+        unsigned long h = hash(key);
+        long block = block_of(h);
+        char *data = buffer_pool.latch(block, true);
+        set_bits(data + line_offset(h), h);
+        buffer_pool.unlatch(block, true, true);
+    }
+
+    void print_stats(ostream &out = cout)
+    {
+        out << "Bloom filter: " << probes << " probes, " << rejected << " rejected without a descent ("
+            << lines * bloom_line / 1024 << " KB)\n";
+    }
+
+    private:
+    long line_of(unsigned long h) const
+    {
+        return (h >> 32) % lines;
+    }
+
+    long block_of(unsigned long h) const
+    {
+        return address + line_of(h) * bloom_line / block_size * block_size;
+    }
+
+    long line_offset(unsigned long h) const
+    {
+        return line_of(h) * bloom_line % block_size;
+    }
+
+    /* the bits of a key are 9 bit fields of a second mix of its hash, each picking one of the 512 bits of its line */
+    static void set_bits(char *line, unsigned long h)
+    {
+        unsigned long g = h * 0x9e3779b97f4a7c15UL;
+        for (int i = 0 ; i < bloom_probes ; i++, g >>= 9)
+            line[(g & 511) / 8] |= 1 << (g & 7);
+    }
+
+    static bool test_bits(const char *line, unsigned long h)
+    {
+        unsigned long g = h * 0x9e3779b97f4a7c15UL;
+        for (int i = 0 ; i < bloom_probes ; i++, g >>= 9)
+        {
+            if ((line[(g & 511) / 8] & (1 << (g & 7))) == 0)
+                return false;
+        }
+        return true;
+    }
+
+    bool counted(bool found)
+    {
+        probes++;
+        if (!found)
+            rejected++;
+        return found;
+    }
+};
+
+// the Bloom filter of the open index file
+BloomFilter bloom;
+
+/* class holding the internal levels of the tree in memory, pinned when the index is opened
+ * (disabled with -nopin), so a lookup descends without touching the buffer pool and reads only its leaf
+ *
+ * Every internal node has a slot in one cache-line aligned arena, laid out in breadth-first order
+ * when it's built. A slot holds three arrays, each contiguous:
+ * heads - the first 8 bytes of every separator as a big-endian integer, searched first
+ * children - slot index of every child, or the leaf address on the lowest internal level
+ * keys - every separator padded with NULs to stored_key_len(), compared past the head only when heads tie
+ *
+ * Inserts keep it consistent: every internal node written by Node::write_to_disk() is staged, and
+ * publish() applies the staged nodes in one step under the exclusive latch, while the writer still
+ * holds its block latches. A changed node is rewritten in its slot, or moved to a new slot at the end
+ * of the arena when it outgrew it. A lookup notes 'version' before descending and checks it again
+ * once its leaf is latched, descending again if the structure was changed in between.
+ *
+ * member variables:
+ * active (bool) - whether the internal levels are pinned
+ * slots (vector<Slot>) - the slots; a Slot records the node's address, the offset of its arrays in
+ *                        'arena', its number of keys, the keys it has room for and whether it is on the
+ *                        lowest internal level
+ * slot_of (unordered_map<long, int>) - slot of every internal node address
+ * root_slot (int) - slot of the root, -1 if the root is a leaf
+ * version (atomic<long>) - bumped by every publish() that changes the structure
+ * latch (shared_mutex) - shared while a lookup descends, exclusive while publish() changes the arrays
+ * descents (atomic<long>) - lookups answered by an in-memory descent
+ */
+class InnerLevels
+{
+    public:
+    struct Slot
+    {
+        long address;
+        long offset;
+        int count;
+        int capacity;
+        bool bottom;
+    };
+
+    bool active;
+    vector<Slot> slots;
+    unordered_map<long, int> slot_of;
+    int root_slot;
+    atomic<long> version;
+    shared_mutex latch;
+    atomic<long> descents;
+
+    InnerLevels() : version(0), descents(0)
+    {
+        active = false;
+        root_slot = -1;
+        arena = NULL;
+        arena_used = arena_size = arena_live = 0;
+    }
+
+    ~InnerLevels()
+    {
+        free(arena);
+    }
+
+    /* read every internal node breadth-first from the root and lay them out in the arena */
+    void build()
+    {
+        unique_lock<shared_mutex> guard(latch);
+        slots.clear();
+        slot_of.clear();
+        staged.clear();
+        arena_used = arena_live = 0;
+        active = true;
+
+        vector<long> level(1, root_address.load());
+        while (!level.empty())
+        {
+            vector<long> below;
+            for (long address : level)
+            {
+                Node n(address);
+                if (n.is_leaf) // reached the leaves: every node of a level is a leaf or none is
+                {
+                    below.clear();
+                    break;
+                }
+                staged.push_back({ address, n.keys, n.children });
+                below.insert(below.end(), n.children.begin(), n.children.end());
+            }
+            level.swap(below);
+        }
+        apply();
+    }
+
+    /* remember an internal node just written, until the next publish() */
+    void stage(long address, const vector<string> &keys, const vector<long> &children)
+    {
+        if (active)
+            staged.push_back({ address, keys, children });
+    }
+
+    /* make the staged nodes and the current root_address visible to lookups in one step */
+    void publish()
+    {
+        if (!active)
+            return;
+        unique_lock<shared_mutex> guard(latch);
+        apply();
+    }
+
+    /* route 'key' through the pinned levels to its leaf, latched shared for the caller as by find_leaf()
+     *
+     * output (bool) - false if the levels are not pinned or can't route this key, so the caller
+     *                 descends through the buffer pool instead
+     */
+    bool find_leaf(const string &key, long &leaf)
+    {
+        if (!active || (int) key.length() > stored_key_len())
+            return false;
+        while (true)
+        {
+            long seen;
+            {
+                shared_lock<shared_mutex> guard(latch);
+                seen = version.load();
+                leaf = route(key);
+            }
+            buffer_pool.latch(leaf, false);
+            if (version.load() == seen)
+            {
+                descents++;
+                return true;
+            }
+            buffer_pool.unlatch(leaf, false, false); // an insert changed the levels meanwhile
+        }
+    }
+
+    /* leaf for each key of a sorted run, without latching (for batches that run alone)
+     *
+     * output (bool) - false if the levels are not pinned; leaves[i] is the leaf of keys[i]
+     */
+    bool route_batch(const vector<pair<string, long> > &keys, vector<long> &leaves)
+    {
+        if (!active)
+            return false;
+        shared_lock<shared_mutex> guard(latch);
+        for (const pair<string, long> &key : keys)
+        {
+            if ((int) key.first.length() > stored_key_len())
+                return false;
+            leaves.push_back(route(key.first));
+        }
+        descents += keys.size();
+        return true;
+    }
+
+    void print_stats(ostream &out = cout)
+    {
+        shared_lock<shared_mutex> guard(latch);
+        out << "Pinned internal levels: " << slots.size() << " nodes in " << arena_used / 1024 << " KB, "
+            << descents << " lookups descended in memory\n";
+    }
+
+    private:
+    struct Staged
+    {
+        long address;
+        vector<string> keys;
+        vector<long> children;
+    };
+
+    static const int line = 64;
+    char *arena;
+    long arena_used; // bytes of the arena handed out to slots
+    long arena_size;
+    long arena_live; // bytes of the arena in slots still in use
+    vector<Staged> staged;
+
+    unsigned long* heads(const Slot &s) const
+    {
+        return (unsigned long*) (arena + s.offset);
+    }
+
+    long* children(const Slot &s) const
+    {
+        return (long*) (arena + s.offset + s.capacity * sizeof(unsigned long));
+    }
+
+    char* keys(const Slot &s) const
+    {
+        return arena + s.offset + s.capacity * sizeof(unsigned long) + (s.capacity + 1) * sizeof(long);
+    }
+
+    static long slot_bytes(int capacity)
+    {
+        long bytes = capacity * sizeof(unsigned long) + (capacity + 1) * sizeof(long) + (long) capacity * stored_key_len();
+        return (bytes + line - 1) / line * line;
+    }
+
+    /* the first 8 bytes of a key padded to stored_key_len(), as a big-endian integer */
+    static unsigned long head(const char *key)
+    {
+        unsigned long h = 0;
+        for (int i = 0 ; i < 8 ; i++)
+            h = (h << 8) | (i < stored_key_len() ? (unsigned char) key[i] : 0);
+        return h;
+    }
+
+    /* descend from the root slot (latch held shared)
+     *
+     * output (long int) - the address of the leaf that may contain 'key'
+     */
+    long route(const string &key) const
+    {
+        if (root_slot == -1)
+            return root_address;
+
+        char padded[stored_key_len()];
+        memset(padded, 0, stored_key_len());
+        memcpy(padded, key.data(), key.length());
+        unsigned long h = head(padded);
+
+        int s = root_slot;
+        while (true)
+        {
+            const Slot &n = slots[s];
+            const unsigned long *hs = heads(n);
+            const char *ks = keys(n);
+
+            // upper bound: the child left of the first separator larger than the key
+            int lo = 0, hi = n.count;
+            while (lo < hi)
+            {
+                int mid = (lo + hi) / 2;
+                bool larger = hs[mid] != h ? hs[mid] > h
+                              : stored_key_len() > 8 && memcmp(ks + (long) mid * stored_key_len() + 8, padded + 8, stored_key_len() - 8) > 0;
+                if (larger)
+                    hi = mid;
+                else
+                    lo = mid + 1;
+            }
+            long child = children(n)[lo];
+            if (n.bottom)
+                return child;
+            s = child;
+        }
+    }
+
+    /* whether slot 's' already holds exactly the staged node */
+    bool unchanged(const Slot &s, const Staged &node) const
+    {
+        if (s.count != (int) node.keys.size())
+            return false;
+        for (int i = 0 ; i < s.count ; i++)
+        {
+            const string &k = node.keys[i];
+            const char *stored = keys(s) + (long) i * stored_key_len();
+            long len = min((long) k.length(), (long) stored_key_len());
+            if (memcmp(stored, k.data(), len) != 0 || (len < stored_key_len() && stored[len] != '\0'))
+                return false;
+        }
+        for (int i = 0 ; i <= s.count ; i++)
+        {
+            long child = children(s)[i];
+            if (node.children[i] != (s.bottom ? child : slots[child].address))
+                return false;
+        }
+        return true;
+    }
+
+    /* hand out 'bytes' of the arena, growing (and compacting) it when it is full */
+    long reserve(long bytes)
+    {
+        if (arena_used + bytes > arena_size)
+        {
+            long size = max(2 * (arena_live + bytes), 64L * 1024);
+            char *grown;
+            if (posix_memalign((void**) &grown, line, size) != 0)
+            {
+                cout << "Out of memory for the pinned internal levels\n";
+                exit(1);
+            }
+            // copy the live slots back to back, in slot order (breadth-first for the built levels)
+            long used = 0;
+            for (Slot &s : slots)
+            {
+                if (s.capacity == 0) // the slot being placed
+                    continue;
+                long b = slot_bytes(s.capacity);
+                memcpy(grown + used, arena + s.offset, b);
+                s.offset = used;
+                used += b;
+            }
+            free(arena);
+            arena = grown;
+            arena_size = size;
+            arena_used = arena_live = used;
+        }
+        long offset = arena_used;
+        arena_used += bytes;
+        arena_live += bytes;
+        return offset;
+    }
+
+    /* write the staged nodes into their slots (latch held exclusively) */
+    void apply()
+    {
+        // a node written more than once since the last publish() counts as its last write
+        vector<Staged> nodes;
+        unordered_map<long, bool> seen;
+        for (long i = (long) staged.size() - 1 ; i >= 0 ; i--)
+        {
+            if (!seen[staged[i].address])
+                nodes.push_back(staged[i]);
+            seen[staged[i].address] = true;
+        }
+        staged.clear();
+        reverse(nodes.begin(), nodes.end());
+
+        bool changed = false;
+        vector<bool> placed(nodes.size(), false);
+        for (size_t j = 0 ; j < nodes.size() ; j++)
+        {
+            const Staged &node = nodes[j];
+            unordered_map<long, int>::iterator it = slot_of.find(node.address);
+            if (it != slot_of.end() && unchanged(slots[it->second], node))
+                continue;
+
+            int count = node.keys.size();
+            int idx;
+            if (it == slot_of.end())
+            {
+                idx = slots.size();
+                slots.push_back({ node.address, 0, 0, 0, false });
+                slot_of[node.address] = idx;
+            }
+            else
+                idx = it->second;
+            if (slots[idx].capacity < count) // outgrown: move to a new slot with room to grow
+            {
+                int capacity = count + count / 4 + 4;
+                arena_live -= slots[idx].capacity > 0 ? slot_bytes(slots[idx].capacity) : 0;
+                long offset = reserve(slot_bytes(capacity));
+                slots[idx].offset = offset;
+                slots[idx].capacity = capacity;
+            }
+            Slot &s = slots[idx];
+            s.count = count;
+            unsigned long *hs = heads(s);
+            char *ks = keys(s);
+            for (int i = 0 ; i < count ; i++)
+            {
+                char *k = ks + (long) i * stored_key_len();
+                memset(k, 0, stored_key_len());
+                memcpy(k, node.keys[i].data(), min((long) node.keys[i].length(), (long) stored_key_len()));
+                hs[i] = head(k);
+            }
+            placed[j] = true;
+            changed = true;
+        }
+
+        // children are resolved once every staged node has its slot
+        for (size_t j = 0 ; j < nodes.size() ; j++)
+        {
+            if (!placed[j])
+                continue;
+            const Staged &node = nodes[j];
+            Slot &s = slots[slot_of[node.address]];
+            s.bottom = slot_of.find(node.children[0]) == slot_of.end();
+            for (size_t i = 0 ; i < node.children.size() ; i++)
+                children(s)[i] = s.bottom ? node.children[i] : slot_of[node.children[i]];
+        }
+
+        unordered_map<long, int>::iterator root = slot_of.find(root_address);
+        int new_root = root == slot_of.end() ? -1 : root->second;
+        if (changed || new_root != root_slot)
+        {
+            root_slot = new_root;
+            version++;
+        }
+    }
+};
+
+// the internal levels pinned in memory at open
+InnerLevels inner_levels;
+
+// whether the internal levels are pinned at open (-nopin option turns it off)
+bool pin_inner_levels = true;
+
+void stage_inner_node(long address, const vector<string> &keys, const vector<long> &children)
+{
+    inner_levels.stage(address, keys, children);
+}
+
+/* signature for update_metadata function */
+void update_metadata();
+void checkpoint();
+string encode_payload(long offset);
+
+/* whether a node can be written to its block: at most 2*degree keys in format 1, a block's worth of
+ * bytes in format 2
+ */
+bool node_fits(Node* n)
+{
+    if (format_version == 1)
+        return (int) n->keys.size() <= 2 * degree;
+    return n->encoded_size() <= block_size;
+}
+
+/* whether one more key, or a separator pushed up by a child split, is sure to fit in a node, so that
+ * an insert below it can't split it
+ */
+bool node_safe(Node* n)
+{
+    if (format_version == 1)
+        return (int) n->keys.size() < 2 * degree;
+
+    // an empty key clears the shared prefix and forces the slot directory, the worst a real key can do
+    Node probe(n->is_leaf, n->keys, n->pointers, n->children);
+    probe.keys.push_back("");
+    if (probe.is_leaf)
+        probe.pointers.push_back(data_device.end_offset); // inserted records are appended, widening packed pointers the most
+    else
+        probe.children.push_back(0);
+    if (probe.has_counts())
+    {
+        probe.counts = n->counts;
+        probe.counts.push_back(0);
+    }
+    if (probe.is_leaf && cover_len != 0)
+    {
+        probe.payloads = n->payloads;
+        probe.payloads.push_back(string(1 + inline_payload_limit(), ' ')); // the longest payload encoding
+    }
+    return probe.encoded_size() + stored_key_len() <= block_size;
+}
+
+/* create a new node with the upper half of an overfull internal node's keys and pointers
+ * (degree keys and degree+1 pointers when the node has 2*degree+1 keys)
+ *
+ * input parameters:
+ * index (Node *) - the internal node to be split
+ * parent_key (Node *) - store the middle key (middle of the split) in this variable
+ *
+ * output (Node *) - the node that was created that contains half the keys of the internal node
+ */
+Node* split_index_node(Node* index, string &parent_key) 
+{
+    // splitting internal node - has (2*mid + 1) keys and (2*mid + 2) pointers
+    int mid = index->keys.size() / 2;
+    parent_key = index->keys[mid];
+    
+    // keep first mid keys and mid+1 pointers
+    // move the keys after the middle one and their pointers to new node
+    vector<string> new_keys(index->keys.begin() + mid + 1, index->keys.end());
+    vector<long> new_children(index->children.begin() + mid + 1, index->children.end());
+    index->keys.resize(mid);
+    index->children.resize(mid + 1);
+
+    vector<long> v1;
+    Node* new_node = new Node(false, new_keys, v1, new_children);
+    if (index->has_counts())
+    {
+        new_node->counts.assign(index->counts.begin() + mid + 1, index->counts.end());
+        index->counts.resize(mid + 1);
+    }
+
+    return new_node;
+}
+
+/* create a new node with the upper half of an overfull leaf's entries and remove them from the leaf
+ * (degree+1 entries when the leaf has 2*degree+1)
+ *
+ * input parameters:
+ * leaf (Node *) - the leaf to be split
+ *
+ * output (Node *) - the node that was created that contains half the keys of the leaf
+ */
+Node* split_leaf_node(Node* leaf) 
+{
+    // keep the first half of the entries in the original leaf node
+    int mid = leaf->keys.size() / 2;
+
+    // payloads differ in length, so a covering leaf is halved by bytes rather than by entries
+    if (!leaf->payloads.empty())
+    {
+        long entry = stored_key_len() + sizeof(long) + 2; // key, pointer and payload slot of each entry
+        long total = 0, half = 0;
+        for (const string &payload : leaf->payloads)
+            total += entry + payload.length();
+        for (mid = 0 ; mid + 1 < (int) leaf->payloads.size() && 2 * (half + entry + (long) leaf->payloads[mid].length()) <= total ; mid++)
+            half += entry + leaf->payloads[mid].length();
+        mid = max(mid, 1);
+    }
+
+    // move the rest of the entries to the new node
+    vector<string> new_keys(leaf->keys.begin() + mid, leaf->keys.end());
+    vector<long> new_pointers(leaf->pointers.begin() + mid, leaf->pointers.end());
+    leaf->keys.resize(mid);
+    leaf->pointers.resize(mid);
+    
+    vector<long> v1;
+    Node* new_node = new Node(true, new_keys, new_pointers, v1);
+    if (!leaf->payloads.empty())
+    {
+        new_node->payloads.assign(leaf->payloads.begin() + mid, leaf->payloads.end());
+        leaf->payloads.resize(mid);
+    }
+    
+    return new_node;
+}
+
+/* divide an overfull node into as few evenly filled nodes as will fit (used by batch inserts)
+ * the first piece stays in 'n'; a leaf's separators are truncated with separator_key(), while an
+ * internal node moves up the key between each pair of pieces
+ *
+ * input parameters:
+ * n (Node *) - the node to divide, left holding the first piece
+ * separators (vector<string>) - set to the parent key in front of each of the other pieces
+ *
+ * output (vector<Node *>) - the other pieces in key order, not yet written
+ */
+vector<Node*> split_node_evenly(Node* n, vector<string> &separators)
+{
+    vector<string> keys = n->keys;
+    vector<long> values = n->is_leaf ? n->pointers : n->children;
+    long entries = values.size(); // a leaf has one value per key, an internal node one child more
+    vector<long> v1;
+
+    for (long m = 2 ; ; m++)
+    {
+        vector<Node*> pieces;
+        separators.clear();
+        bool fits = true;
+        for (long j = 0 ; j < m ; j++)
+        {
+            long start = entries * j / m;
+            long end = entries * (j + 1) / m;
+            vector<long> piece_values(values.begin() + start, values.begin() + end);
+            Node* piece;
+            if (n->is_leaf)
+            {
+                vector<string> piece_keys(keys.begin() + start, keys.begin() + end);
+                piece = new Node(true, piece_keys, piece_values, v1);
+                if (!n->payloads.empty())
+                    piece->payloads.assign(n->payloads.begin() + start, n->payloads.begin() + end);
+                if (j > 0)
+                    separators.push_back(separator_key(keys[start - 1], keys[start]));
+            }
+            else
+            {
+                // children start..end-1 are separated by keys start..end-2, and keys[start-1] moves up
+                vector<string> piece_keys(keys.begin() + start, keys.begin() + end - 1);
+                piece = new Node(false, piece_keys, v1, piece_values);
+                if (n->has_counts())
+                    piece->counts.assign(n->counts.begin() + start, n->counts.begin() + end);
+                if (j > 0)
+                    separators.push_back(keys[start - 1]);
+            }
+            fits = fits && node_fits(piece);
+            pieces.push_back(piece);
+        }
+
+        if (fits)
+        {
+            n->keys = pieces[0]->keys;
+            n->payloads = pieces[0]->payloads;
+            n->counts = pieces[0]->counts;
+            if (n->is_leaf)
+                n->pointers = pieces[0]->pointers;
+            else
+                n->children = pieces[0]->children;
+            delete pieces[0];
+            pieces.erase(pieces.begin());
+            return pieces;
+        }
+        for (Node* piece : pieces)
+            delete piece;
+    }
+}
+
+/* inserts a key-offset pair in the bplus tree
+ *
+ * input parameters:
+ * root (Node *) - the current node being inserted in or probed
+ * key (string) - the key to be inserted
+ * offset (long integer) - the offset in the data file where the key can be found
+ * split_key (string) - set to the separator key for the parent when this node was split
+ * split_entries (long integer) - set to the number of entries below the new right sibling when this node was split
+ *
+ * output (unique_ptr<Node>) - the new (already written) right sibling if root was split or empty in the general case
+ */
+unique_ptr<Node> insert_record_in_btree(Node* root, string key, long offset, string &split_key, long &split_entries)
+{
+    root->read_from_disk(); // bring root into the memory buffer
+    bool is_root = root->address == root_address; // before a copy-on-write index moves it
+    if(!root->is_leaf) // root is internal node
+    {
+        // find the position of the first key which is greater than key to insert
+        Node* index = root;
+        int posn_key = upper_bound_key(index->keys, key);
+
+        // insert this entry recursively in the ith child pointer of this internal node
+        string newchild_key;
+        long newchild_entries = 0;
+        unique_ptr<Node> child = index->get_child(posn_key);
+        unique_ptr<Node> newchild = insert_record_in_btree(child.get(), key, offset, newchild_key, newchild_entries);
+        if (index->has_counts())
+            index->counts[posn_key]++;
+        bool relocated = child->address != index->children[posn_key]; // copy-on-write: the child has a new block
+        index->children[posn_key] = child->address;
+        
+        if(newchild == NULL) // no splitting occurred in this node's child
+        {
+            if (index->has_counts() || relocated) // only the entry count or the address of the child changed
+                index->write_to_disk();
+            return nullptr;
+        } 
+
+        // splitting occurred - the child at posn_key kept the lower half, so the separator goes
+        // in at posn_key and the new right sibling becomes child posn_key + 1
+        index->keys.insert(index->keys.begin() + posn_key, newchild_key);
+        index->children.insert(index->children.begin() + posn_key + 1, newchild->address);
+        if (index->has_counts())
+        {
+            index->counts[posn_key] -= newchild_entries;
+            index->counts.insert(index->counts.begin() + posn_key + 1, newchild_entries);
+        }
+
+        // insert the new pointer in this node as it has space remaining
+        if (node_fits(index))
+        {
+            index->write_to_disk(); // write out to file and delete from buffer
+            return nullptr;
+        }
+
+        // split this node because it's full - original node is index and new node is newchild
+        string parent_key = "";
+        newchild.reset(split_index_node(index, parent_key));
+        long kept = index->entries(), moved = newchild->entries();
+        newchild->write_to_disk();
+
+        // root was just split
+        if (is_root) 
+        {
+            // create a new node new_root containing index and newchild nodes as pointers
+            // and make the root bptree's pointer point to new_root
+            index->write_to_disk();
+
+            // add the index and newchild as children of the new_root
+            vector<long> new_children;
+            new_children.push_back(index->address);
+            new_children.push_back(newchild->address);
+
+            vector<long> v1; // empty variable that will be ignored in the constructor
+            vector<string> newkeys;
+            newkeys.push_back(parent_key);
+
+            // create the new_root
+            Node new_root(false, newkeys, v1, new_children);
+            if (new_root.has_counts())
+                new_root.counts = { kept, moved };
+            new_root.write_to_disk();
+
+            // update the root_address and update the first metadata block using update_metadata()
+            root_address = new_root.address;
+            update_metadata();
+
+            return nullptr;
+        }
+
+        index->write_to_disk();
+        split_key = parent_key;
+        split_entries = moved;
+        return newchild;
+    }
+    else // root is leaf node
+    {
+        Node* leaf = root;
+        
+        // find the position of the first key which is greater than key to insert
+        int key_idx = upper_bound_key(leaf->keys, key);
+        leaf->keys.insert(leaf->keys.begin() + key_idx, key);
+        leaf->pointers.insert(leaf->pointers.begin() + key_idx, offset);
+        if (cover_len != 0)
+            leaf->payloads.insert(leaf->payloads.begin() + key_idx, encode_payload(offset));
+
+        // since this leaf has space, insert this entry recursively in the ith position
+        if(node_fits(leaf)) 
+        {
+            leaf->write_to_disk();
+            return nullptr;
+        }
+
+        // leaf is full, move the upper half into a new right sibling
+        unique_ptr<Node> newchild(split_leaf_node(leaf));
+        string newchild_key = separator_key(leaf->keys.back(), newchild->keys[0]);
+        long kept = leaf->keys.size(), moved = newchild->keys.size();
+
+        // set prev/next siblings - newchild goes between leaf and leaf's old next sibling
+        // (the leaves of a copy-on-write index aren't chained, since that would rewrite the whole level)
+        long tmp = leaf->next;
+        if (!shadow.active)
+        {
+            newchild->prev = leaf->address;
+            newchild->next = tmp;
+        }
+        newchild->write_to_disk(); // appends and assigns newchild's address
+        if (tmp != -1 && !shadow.active) 
+        {
+            Node n(tmp);
+            n.prev = newchild->address;
+            n.write_to_disk();
+        }
+        if (!shadow.active)
+            leaf->next = newchild->address;
+        leaf->write_to_disk();
+
+        if (is_root) // if this leaf was the root, make a new root
+        {
+            vector<string> newkeys;
+            newkeys.push_back(newchild_key);
+
+            // add leaf and newchild pointers to our new_root
+            vector<long> new_children;
+            new_children.push_back(leaf->address);
+            new_children.push_back(newchild->address);
+            vector<long> v1;
+
+            // create the new_root
+            Node new_root(false, newkeys, v1, new_children);
+            if (new_root.has_counts())
+                new_root.counts = { kept, moved };
+            new_root.write_to_disk();
+
+            // update the root_address and update the first metadata block using update_metadata()
+            root_address = new_root.address;
+            update_metadata();
+
+            return nullptr;
+        }
+
+        split_key = newchild_key;
+        split_entries = moved;
+        return newchild;
+    }
+}
+
+/* inserts a key-offset pair while lookups and scans run in other threads (latch crabbing)
+ * the path from the root is latched exclusively top down; whenever a node is safe (see node_safe())
+ * the latches above it are released, since a split can't propagate past it. insert_record_in_btree()
+ * then runs from the highest node still latched, so it only modifies blocks this thread holds.
+ * a leaf that may split also latches its right sibling, whose prev pointer changes.
+ * in format 3 the entry counts of the released nodes above it are then raised one node at a time,
+ * each under its own exclusive latch (inserts run one at a time, so the path can't change meanwhile).
+ *
+ * input parameters:
+ * key (string) - the key to be inserted
+ * offset (long integer) - the offset in the data file where the key can be found
+ */
+void insert_key(string key, long offset)
+{
+    bloom.add(key); // before the key is reachable, so the filter never rejects a key in the tree
+
+    // a copy-on-write index changes no block a lookup can reach, so it needs no latches: the new path
+    // becomes visible when root_address is set to its root
+    if (shadow.active)
+    {
+        long old_root = root_address;
+        Node root(old_root);
+        string split_key;
+        long split_entries;
+        insert_record_in_btree(&root, key, offset, split_key, split_entries);
+        if (root_address == old_root) // not split, only moved
+            root_address = root.address;
+        return;
+    }
+
+    vector<long> held; // exclusively latched blocks, top down
+    vector<pair<long, int> > path; // every node descended through and the child taken
+    long sibling = -1;
+    root_latch.lock();
+    bool root_held = true;
+
+    long address = root_address;
+    while (true)
+    {
+        buffer_pool.latch(address, true);
+        Node n(address);
+        if (node_safe(&n))
+        {
+            for (long a : held)
+                buffer_pool.unlatch(a, true, false);
+            held.clear();
+            if (root_held)
+                root_latch.unlock();
+            root_held = false;
+        }
+        held.push_back(address);
+
+        if (n.is_leaf)
+        {
+            if (!node_safe(&n) && n.next != -1)
+            {
+                sibling = n.next;
+                buffer_pool.latch(sibling, true);
+            }
+            break;
+        }
+        int c = upper_bound_key(n.keys, key);
+        path.push_back(make_pair(address, c));
+        address = n.children[c];
+    }
+
+    Node top(held[0]);
+    string split_key;
+    long split_entries;
+    insert_record_in_btree(&top, key, offset, split_key, split_entries);
+    inner_levels.publish(); // while the changed blocks are still latched
+
+    if (sibling != -1)
+        buffer_pool.unlatch(sibling, true, false);
+    for (long a : held)
+        buffer_pool.unlatch(a, true, false);
+    if (root_held)
+        root_latch.unlock();
+
+    for (const pair<long, int> &step : path)
+    {
+        if (step.first == held[0] || format_version != 3)
+            break;
+        buffer_pool.latch(step.first, true);
+        Node n(step.first);
+        n.counts[step.second]++;
+        n.write_to_disk();
+        buffer_pool.unlatch(step.first, true, true);
+    }
+    inner_levels.publish(); // nothing but counts changed, so lookups aren't disturbed
+}
+
+// records are printed up to their newline or this many bytes, whichever comes first
+const int max_record_length = 1000;
+
+/* length of the record at the start of the 'got' bytes read into buf, up to its newline */
+long record_end(const char *buf, long got)
+{
+    const char *end = (const char*) memchr(buf, '\n', got);
+    long len = end ? end - buf : got;
+    const char *nul = (const char*) memchr(buf, '\0', len); // stop at a NUL like the original string copy did
+    return nul ? nul - buf : len;
+}
+
+/* read the record at 'offset' in the data file into buf (max_record_length bytes)
+ *
+ * output (long int) - length of the record, up to its newline
+ */
+long read_record(long offset, char *buf)
+{
+    return record_end(buf, data_device.read_at(offset, buf, max_record_length));
+}
+
+// payloads too long to keep in a leaf are appended back to back to a run of overflow blocks:
+// the next free byte of the current run and the end of the run
+long overflow_tail = 0;
+long overflow_end = 0;
+
+/* build the leaf payload of a covering index for the record at 'offset' (see payload_inline),
+ * writing its bytes to the overflow blocks when they are too long for the leaf
+ *
+ * output (string) - the encoded payload
+ */
+string encode_payload(long offset)
+{
+    char buf[max_record_length];
+    long len = read_record(offset, buf);
+    long start = min((long) cover_start, len);
+    long n = cover_len == -1 ? len - start : min((long) cover_len, len - start);
+    if (n <= inline_payload_limit())
+        return string(1, payload_inline) + string(buf + start, n);
+
+    if (overflow_end - overflow_tail < n)
+    {
+        long blocks = (n + block_size - 1) / block_size;
+        long address = buffer_pool.allocate(blocks);
+        if (address != overflow_end) // the new run doesn't continue the current one
+            overflow_tail = address;
+        overflow_end = address + blocks * block_size;
+    }
+
+    long address = overflow_tail;
+    for (long done = 0 ; done < n ; )
+    {
+        long block = (overflow_tail / block_size) * block_size;
+        long chunk = min(n - done, block + block_size - overflow_tail);
+        char *data = buffer_pool.pin(block);
+        memcpy(data + overflow_tail - block, buf + start + done, chunk);
+        buffer_pool.unpin(block, true);
+        overflow_tail += chunk;
+        done += chunk;
+    }
+
+    int length = n;
+    string payload(1 + sizeof(address) + sizeof(length), payload_overflow);
+    memcpy(&payload[1], &address, sizeof(address));
+    memcpy(&payload[1 + sizeof(address)], &length, sizeof(length));
+    return payload;
+}
+
+/* the covered bytes of an encoded payload, following it to the overflow blocks if needed
+ *
+ * input parameters:
+ * payload (const char *) - the encoded payload, 'len' bytes long
+ * mapped (const char *) - the index file mapping to read overflow blocks from, or NULL for the buffer pool
+ *
+ * output (string) - the covered bytes of the record
+ */
+string decode_payload(const char *payload, long len, const char *mapped = NULL)
+{
+    if (payload[0] == payload_inline)
+        return string(payload + 1, len - 1);
+
+    long address;
+    int length;
+    memcpy(&address, payload + 1, sizeof(address));
+    memcpy(&length, payload + 1 + sizeof(address), sizeof(length));
+    if (mapped != NULL)
+        return string(mapped + address, length);
+
+    string bytes;
+    while ((int) bytes.length() < length)
+    {
+        long block = (address / block_size) * block_size;
+        long chunk = min(length - (long) bytes.length(), block + block_size - address);
+        const char *data = buffer_pool.pin(block);
+        bytes.append(data + address - block, chunk);
+        buffer_pool.unpin(block, false);
+        address += chunk;
+    }
+    return bytes;
+}
+
+/* descend from the root to the leaf that may contain 'key', searching each node's keys in place
+ * inside its buffer pool block instead of building a Node
+ * each child is latched (shared) before its parent is released, so a concurrent insert is either
+ * entirely before or entirely after this descent at every level
+ *
+ * output (long int) - the address of the leaf, left latched shared: the caller unlatches it
+ */
+long find_leaf(const string &key)
+{
+    long leaf;
+    if (inner_levels.find_leaf(key, leaf))
+        return leaf;
+
+    root_latch.lock_shared();
+    long address = root_address;
+    NodeView n(buffer_pool.latch(address, false));
+    root_latch.unlock_shared();
+
+    while (!n.is_leaf())
+    {
+        long child = n.value(n.upper_bound(key.c_str(), key.length()));
+        n = NodeView(buffer_pool.latch(child, false));
+        buffer_pool.unlatch(address, false, false);
+        address = child;
+    }
+    return address;
+}
+
+/* find a record in the current index_filename
+ *
+ * input parameters:
+ * key (string) - key to search for
+ * payload (string *) - if given and the index is covering, set to the covered bytes of the record
+ *
+ * output (long int) - the offset of the key or -1
+ */
+long find_record(string key, string *payload = NULL)
+{
+    if (!bloom.may_contain(key))
+        return -1;
+
+    Snapshot snapshot;
+    long leaf_address = find_leaf(key);
+    NodeView leaf(buffer_pool.pin(leaf_address));
+
+    // the first key that is not smaller than the target is the only possible match
+    long p = -1;
+    int idx = leaf.lower_bound(key.c_str(), key.length());
+    if (idx < leaf.count() && leaf.compare_at(idx, key.c_str(), key.length()) == 0)
+    {
+        p = leaf.value(idx);
+        if (payload != NULL && cover_len != 0)
+        {
+            long len;
+            const char *encoded = leaf.payload(idx, len);
+            *payload = decode_payload(encoded, len);
+        }
+    }
+
+    buffer_pool.unpin(leaf_address, false);
+    buffer_pool.unlatch(leaf_address, false, false);
+    return p; // -1 if no key matches
+}
+
+/* helper function for printing a record at a specified offset in the data_filename */
+void print_record_at_offset(long key_offset, ostream &out = cout)
+{
+    // read from the offset address, till end of line
+    char buf[max_record_length];
+    long len = read_record(key_offset, buf);
+    out.write(buf, len);
+    out << "\n";
+}
+
+/* class collecting output in a large buffer and handing it to an ostream in big writes, instead of
+ * flushing the stream line by line
+ *
+ * member variables:
+ * out (ostream &) - where the output goes
+ * buffer (vector<char>) - output not yet handed over
+ * used (long) - bytes of 'buffer' in use
+ */
+class BufferedWriter
+{
+    public:
+    ostream &out;
+    vector<char> buffer;
+    long used;
+
+    BufferedWriter(ostream &o, long size = 1 << 20) : out(o), buffer(size)
+    {
+        used = 0;
+    }
+
+    ~BufferedWriter()
+    {
+        flush();
+    }
+
+    void write(const char *s, long len)
+    {
+        if (used + len > (long) buffer.size())
+            flush();
+        if (len > (long) buffer.size())
+        {
+            out.write(s, len);
+            return;
+        }
+        memcpy(buffer.data() + used, s, len);
+        used += len;
+    }
+
+    void put(const string &s)
+    {
+        write(s.data(), s.length());
+    }
+
+    void flush()
+    {
+        out.write(buffer.data(), used);
+        out.flush();
+        used = 0;
+    }
+};
+
+/* ask the OS to start reading the data file blocks behind 'offsets' (posix_fadvise WILLNEED), so the
+ * reads are in flight together instead of one blocking read per record; records close together in
+ * the file are requested as one range
+ */
+void prefetch_records(vector<long> offsets)
+{
+    sort(offsets.begin(), offsets.end());
+    for (size_t i = 0 ; i < offsets.size() ; )
+    {
+        long start = offsets[i];
+        long end = offsets[i] + max_record_length;
+        while (++i < offsets.size() && offsets[i] <= end + 4096)
+            end = offsets[i] + max_record_length;
+        posix_fadvise(data_device.fd, start, end - start, POSIX_FADV_WILLNEED);
+    }
+}
+
+/* fetch the data file records at 'offsets' through io_engine, with up to the engine depth of reads in flight
+ *
+ * output (void) - records[i] holds the record at offsets[i], up to its newline
+ */
+void fetch_records(const vector<long> &offsets, vector<string> &records)
+{
+    records.assign(offsets.size(), string());
+    long slots = min((long) io_engine.depth, (long) offsets.size());
+    vector<char> buffers(slots * max_record_length);
+    vector<long> free_slots;
+    for (long s = slots - 1 ; s >= 0 ; s--)
+        free_slots.push_back(s);
+    vector<long> slot_of(offsets.size());
+
+    size_t next = 0;
+    long in_flight = 0;
+    while (next < offsets.size() || in_flight > 0)
+    {
+        for ( ; next < offsets.size() && !free_slots.empty() ; next++)
+        {
+            slot_of[next] = free_slots.back();
+            free_slots.pop_back();
+            io_engine.read(data_device, buffers.data() + slot_of[next] * max_record_length, max_record_length, offsets[next], next);
+            in_flight++;
+        }
+        io_engine.submit();
+
+        long bytes = 0;
+        long tag = io_engine.wait(bytes);
+        if (tag == -1)
+        {
+            cout << "I/O engine lost " << in_flight << " record reads\n";
+            exit(1);
+        }
+        in_flight--;
+        const char *buf = buffers.data() + slot_of[tag] * max_record_length;
+        records[tag].assign(buf, record_end(buf, max(0L, bytes)));
+        free_slots.push_back(slot_of[tag]);
+    }
+}
+
+/* class iterating over the leaf entries in key order from a start key (the range scans of -list)
+ *
+ * Leaves are copied out of the buffer pool under a shared latch, so the cursor holds no pins or
+ * latches between calls. While the caller works through the current leaf, the next one is already
+ * read ("ahead"), the block after it and the records behind the pointers of both are being
+ * prefetched by the OS.
+ *
+ * The leaves of a copy-on-write index aren't chained, so the cursor keeps the path from the root to the
+ * last leaf it read and finds the leaf after it through their parents, all in the snapshot it started on.
+ *
+ * member variables:
+ * leaf (Node) - the current leaf
+ * ahead (Node) - the leaf after it, read once the scan is expected to reach it
+ * pos (int) - the current entry in 'leaf'
+ * wanted (long) - entries the caller still expects to read, limiting how far ahead to prefetch
+ * snapshot (Snapshot) - keeps the blocks of a copy-on-write index from being reused during the scan
+ * path (vector<pair<long, int>>) - copy-on-write index: the internal nodes above the last leaf read and
+ *                                  the child taken in each
+ */
+class RangeCursor
+{
+    public:
+    Node leaf;
+    Node ahead;
+    int pos;
+    long wanted;
+    Snapshot snapshot;
+    vector<pair<long, int> > path;
+
+    RangeCursor() : leaf(-1L), ahead(-1L)
+    {
+        pos = 0;
+        wanted = 0;
+    }
+
+    /* position on the first entry not smaller than 'key'
+     *
+     * input parameters:
+     * key (string) - where the scan starts
+     * count (long) - number of entries the caller expects to read
+     */
+    void seek(const string &key, long count)
+    {
+        if (shadow.active)
+            descend(key);
+        else
+        {
+            leaf.address = find_leaf(key);
+            leaf.read_from_disk();
+            buffer_pool.unlatch(leaf.address, false, false);
+        }
+        pos = lower_bound(leaf.keys.begin(), leaf.keys.end(), key) - leaf.keys.begin();
+        wanted = count;
+        ahead.address = -1;
+        prefetch(leaf, pos);
+        read_ahead();
+    }
+
+    bool at_leaf_end() const
+    {
+        return pos >= (int) leaf.keys.size();
+    }
+
+    /* move to the first entry of the next leaf
+     *
+     * output (bool) - false at the end of the leaf chain
+     */
+    bool next_leaf()
+    {
+        if (leaf.next == -1)
+            return false;
+        if (ahead.address != leaf.next)
+            load(ahead, leaf.next);
+        swap(leaf, ahead);
+        pos = 0;
+        read_ahead();
+        return true;
+    }
+
+    private:
+    /* copy the leaf at 'address' under a shared latch */
+    void load(Node &n, long address)
+    {
+        buffer_pool.latch(address, false);
+        n.flush_node();
+        n.address = address;
+        n.read_from_disk();
+        buffer_pool.unlatch(address, false, false);
+        if (shadow.active)
+            n.next = successor();
+    }
+
+    /* copy-on-write index: read the leaf that may contain 'key', noting the path down to it */
+    void descend(const string &key)
+    {
+        path.clear();
+        long address = root_address;
+        while (true)
+        {
+            NodeView n(buffer_pool.pin(address));
+            if (n.is_leaf())
+            {
+                buffer_pool.unpin(address, false);
+                break;
+            }
+            int c = n.upper_bound(key.c_str(), key.length());
+            long child = n.value(c);
+            buffer_pool.unpin(address, false);
+            path.push_back(make_pair(address, c));
+            address = child;
+        }
+        load(leaf, address);
+    }
+
+    /* copy-on-write index: move the path on to the leaf after the last one read
+     *
+     * output (long int) - the address of that leaf, -1 past the last leaf
+     */
+    long successor()
+    {
+        // go up to the nearest node with a child right of the path, then down its leftmost children
+        while (!path.empty())
+        {
+            NodeView n(buffer_pool.pin(path.back().first));
+            int c = ++path.back().second;
+            long child = c <= n.count() ? n.value(c) : -1;
+            buffer_pool.unpin(path.back().first, false);
+            if (child == -1)
+            {
+                path.pop_back();
+                continue;
+            }
+            while (true)
+            {
+                NodeView down(buffer_pool.pin(child));
+                bool leaf_level = down.is_leaf();
+                long first = leaf_level ? -1 : down.value(0);
+                buffer_pool.unpin(child, false);
+                if (leaf_level)
+                    return child;
+                path.push_back(make_pair(child, 0));
+                child = first;
+            }
+        }
+        return -1;
+    }
+
+    /* prefetch the records from entry 'from' of 'n' that the caller still wants */
+    void prefetch(const Node &n, int from)
+    {
+        if (cover_len != 0) // a covering index doesn't read the records
+            return;
+        long last = min((long) n.pointers.size(), from + max(0L, wanted));
+        if (from < last)
+            prefetch_records(vector<long>(n.pointers.begin() + from, n.pointers.begin() + last));
+    }
+
+    /* read the next leaf if the scan will get past this one, and prefetch what it points at */
+    void read_ahead()
+    {
+        wanted -= leaf.keys.size() - pos;
+        if (leaf.next == -1 || wanted <= 0)
+            return;
+        load(ahead, leaf.next);
+        prefetch(ahead, 0);
+        if (ahead.next != -1)
+            posix_fadvise(index_device.fd, ahead.next, block_size, POSIX_FADV_WILLNEED);
+    }
+};
+
+/* helper function for list_records() */
+void list_records_count(string target_key, int count, ostream &out = cout)
+{
+    if (count <= 0)
+        return;
+
+    RangeCursor cursor;
+    cursor.seek(target_key, count);
+
+    // the records behind a leaf are read together through io_engine unless another scan is using it
+    unique_lock<mutex> engine(io_engine.owner, try_to_lock);
+    if (cover_len == 0 && engine.owns_lock())
+        io_engine.start();
+    bool batched = cover_len == 0 && engine.owns_lock() && io_engine.kind != "sync";
+
+    // start printing from here till 'count' next entries, with a blank line after every leaf
+    BufferedWriter writer(out);
+    char buf[max_record_length];
+    vector<string> records;
+    while (true)
+    {
+        int first = cursor.pos;
+        if (batched)
+        {
+            long last = min((long) cursor.leaf.pointers.size(), first + (long) count);
+            fetch_records(vector<long>(cursor.leaf.pointers.begin() + first, cursor.leaf.pointers.begin() + last), records);
+        }
+        for ( ; !cursor.at_leaf_end() && count > 0 ; cursor.pos++, count--)
+        {
+            long offset = cursor.leaf.pointers[cursor.pos];
+            writer.put("[" + to_string(offset) + "]: ");
+            if (cover_len != 0)
+            {
+                const string &payload = cursor.leaf.payloads[cursor.pos];
+                writer.put(decode_payload(payload.data(), payload.length()));
+            }
+            else if (batched)
+                writer.put(records[cursor.pos - first]);
+            else
+                writer.write(buf, read_record(offset, buf));
+            writer.write("\n", 1);
+        }
+        writer.write("\n", 1);
+
+        if (count <= 0 || !cursor.next_leaf()) // follow the next pointer to a sibling leaf node
+            break;
+    }
+}
+
+/* class representing the index and data files mapped read-only for -find and -list (-mmap option)
+ *
+ * Nodes are interpreted in place inside the mapping, so once the files are in the OS page cache a
+ * lookup makes no system calls and no allocations.
+ *
+ * member variables:
+ * index (const char *) - the mapped index file
+ * index_size (long) - length of the index mapping
+ * data (const char *) - the mapped data file
+ * data_size (long) - length of the data mapping
+ */
+class MappedIndex
+{
+    public:
+    const char *index;
+    long index_size;
+    const char *data;
+    long data_size;
+
+    MappedIndex()
+    {
+        index = data = NULL;
+        index_size = data_size = 0;
+    }
+
+    /* map the index and data files opened by initialize_bplus_tree()
+     *
+     * output (bool) - false if either file can't be mapped
+     */
+    bool open()
+    {
+        index = map(index_device, index_size);
+        data = map(data_device, data_size);
+        if (index == NULL || (data == NULL && data_size > 0))
+            return false;
+        advise(MADV_RANDOM); // a descent touches one block per level
+        return true;
+    }
+
+    /* pass an madvise() hint for the whole index mapping */
+    void advise(int advice)
+    {
+        madvise((void*) index, index_size, advice);
+    }
+
+    NodeView node(long address) const
+    {
+        return NodeView(index + address);
+    }
+
+    /* length of the record at 'offset' in the data file, up to the end of its line */
+    long record_length(long offset) const
+    {
+        long len = min((long) max_record_length, data_size - offset);
+        const char *end = (const char*) memchr(data + offset, '\n', len);
+        return end ? end - (data + offset) : len;
+    }
+
+    /* print the record at 'offset' in the data file, up to the end of its line */
+    void print_record(long offset, ostream &out = cout) const
+    {
+        out.write(data + offset, record_length(offset));
+        out << "\n";
+    }
+
+    /* covered bytes of the ith entry of a covering index leaf */
+    string payload(const NodeView &leaf, int i) const
+    {
+        long len;
+        const char *encoded = leaf.payload(i, len);
+        return decode_payload(encoded, len, index);
+    }
+
+    private:
+    const char* map(BlockDevice &device, long &size)
+    {
+        size = device.end_offset;
+        if (size == 0)
+            return NULL;
+        void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, device.fd, 0);
+        return p == MAP_FAILED ? NULL : (const char*) p;
+    }
+};
+
+// whether -find and -list read the index through a read-only mapping (-mmap option)
+bool use_mmap = false;
+
+/* descend from the root of the mapped index to the leaf that may contain 'key'
+ *
+ * output (NodeView) - the leaf
+ */
+NodeView find_leaf_mapped(const MappedIndex &mapped, const char *key, long len)
+{
+    NodeView n = mapped.node(root_address);
+    while (!n.is_leaf())
+        n = mapped.node(n.value(n.upper_bound(key, len))); // the child left of the first larger key
+    return n;
+}
+
+/* find_record() over the mapped index
+ *
+ * output (long int) - the offset of the key or -1
+ */
+long find_record_mapped(const MappedIndex &mapped, const char *key, long len, string *payload = NULL)
+{
+    if (!bloom.may_contain_mapped(mapped.index, string(key, len)))
+        return -1;
+
+    NodeView leaf = find_leaf_mapped(mapped, key, len);
+    int idx = leaf.lower_bound(key, len);
+    if (idx < leaf.count() && leaf.compare_at(idx, key, len) == 0)
+    {
+        if (payload != NULL && cover_len != 0)
+            *payload = mapped.payload(leaf, idx);
+        return leaf.value(idx);
+    }
+    return -1;
+}
+
+/* list_records_count() over the mapped index */
+void list_records_mapped(MappedIndex &mapped, string target_key, int count, ostream &out = cout)
+{
+    NodeView leaf = find_leaf_mapped(mapped, target_key.c_str(), target_key.length());
+
+    // start from the first key that matches or is larger than the target
+    int i = leaf.lower_bound(target_key.c_str(), target_key.length());
+
+    mapped.advise(MADV_SEQUENTIAL); // the scan walks the leaf chain
+    BufferedWriter writer(out);
+    while (count > 0)
+    {
+        for (int a = i ; a < leaf.count() && count > 0 ; a++)
+        {
+            long offset = leaf.value(a);
+            writer.put("[" + to_string(offset) + "]: ");
+            if (cover_len != 0)
+                writer.put(mapped.payload(leaf, a));
+            else
+                writer.write(mapped.data + offset, mapped.record_length(offset));
+            writer.write("\n", 1);
+            count--;
+        }
+        writer.write("\n", 1);
+        i = 0;
+
+        if (leaf.next() == -1)
+            break;
+        leaf = mapped.node(leaf.next());
+    }
+}
+
+/* fills the global variables after reading data from the first metadata block
+ *
+ * output (void) -reads the metadata block at address 0 only
+ */
+void initialize_bplus_tree()
+{
+    // read the metadata at the start of the first block to get the data filename, keylength, degree and block size
+    long offset = 0;
+    char buffer[metadata_size];
+
+    if (!index_device.open(index_filename, false, use_direct_io))
+    {
+        cout << "Cannot open index file " << index_filename << "\n";
+        exit(1);
+    }
+    index_device.read_at(0, buffer, metadata_size);
+
+    // read data_filename
+    string get_data_filename(buffer, 257);
+    int end_idx = get_data_filename.find("0000"); // assumming no filename has 4 0s
+    data_filename = get_data_filename.substr(0, end_idx);
+    offset += 257;
+
+    // read key_len
+    memcpy(&key_len, buffer + offset, sizeof(key_len));
+    offset += sizeof(key_len);
+
+    // read degree
+    memcpy(&degree, buffer + offset, sizeof(degree));
+    offset += sizeof(degree);
+
+    // read root location
+    long root;
+    memcpy(&root, buffer + offset, sizeof(root));
+    root_address = root;
+    offset += sizeof(root);
+
+    // read the node format - indexes written before it was recorded use format 1
+    int magic;
+    memcpy(&magic, buffer + offset, sizeof(magic));
+    offset += sizeof(magic);
+    format_version = 1;
+    if (magic == index_magic)
+        memcpy(&format_version, buffer + offset, sizeof(format_version));
+    offset += sizeof(format_version);
+
+    // read the block size - indexes written before it was recorded use 1024 byte blocks
+    block_size = 1024;
+    if (magic == index_magic)
+        memcpy(&block_size, buffer + offset, sizeof(block_size));
+    if (block_size == 0)
+        block_size = 1024;
+    offset += sizeof(block_size);
+
+    // read the covered byte range - zero (not covering) in indexes written before it was recorded
+    cover_start = cover_len = 0;
+    if (magic == index_magic)
+    {
+        memcpy(&cover_start, buffer + offset, sizeof(cover_start));
+        memcpy(&cover_len, buffer + offset + sizeof(cover_start), sizeof(cover_len));
+    }
+    offset += sizeof(cover_start) + sizeof(cover_len);
+
+    // read the Bloom filter location - no filter (lines 0) in indexes written before it was recorded
+    bloom.address = bloom.lines = 0;
+    if (magic == index_magic)
+    {
+        memcpy(&bloom.address, buffer + offset, sizeof(bloom.address));
+        memcpy(&bloom.lines, buffer + offset + sizeof(bloom.address), sizeof(bloom.lines));
+    }
+    offset += sizeof(bloom.address) + sizeof(bloom.lines);
+
+    // read the indexed end of the data file - zero (unknown) in indexes written before it was recorded
+    synced_end = synced_fingerprint = 0;
+    if (magic == index_magic)
+    {
+        memcpy(&synced_end, buffer + offset, sizeof(synced_end));
+        memcpy(&synced_fingerprint, buffer + offset + sizeof(synced_end), sizeof(synced_fingerprint));
+    }
+    offset += sizeof(synced_end) + sizeof(synced_fingerprint);
+
+    // read the integer key mode - keys stored as they are (width 0) in indexes written before it was recorded
+    int_key_digits = int_key_width = 0;
+    if (magic == index_magic)
+    {
+        memcpy(&int_key_digits, buffer + offset, sizeof(int_key_digits));
+        memcpy(&int_key_width, buffer + offset + sizeof(int_key_digits), sizeof(int_key_width));
+    }
+    offset += sizeof(int_key_digits) + sizeof(int_key_width);
+
+    // a copy-on-write index takes its root from the newest commit record (see ShadowPaging)
+    shadow.attach(buffer);
+
+    if (!data_device.open(data_filename, false, false))
+    {
+        cout << "Cannot open data file " << data_filename << "\n";
+        exit(1);
+    }
+
+    select_search_kernel();
+
+    // replay the inserts committed to the redo log since the last checkpoint into the buffer pool; a
+    // process writing through the log keeps appending to it, one changing the index without it folds
+    // it into the index file if no other process is using it
+    if (wal.open(index_filename))
+    {
+        bool owner = wal.lock();
+        if (wal.device.end_offset > 0)
+        {
+            long root = wal.recover();
+            if (root != -1)
+                root_address = root;
+            if (owner && wal.fold)
+                checkpoint();
+        }
+        if (owner && !wal.active)
+            wal.unlock();
+        if (!wal.replayed.empty())
+            use_mmap = false; // the mapping would miss the blocks only in the log
+    }
+
+    // start with an empty buffer pool for this index file
+    buffer_pool.open(buffer_pool_budget);
+
+    // pin the internal levels unless the tree is still being created (a copy-on-write index moves its
+    // internal nodes on every insert, so lookups descend through the buffer pool instead)
+    if (pin_inner_levels && index_device.end_offset > root_address && !shadow.active)
+        inner_levels.build();
+}
+
+/* class that builds a B+ tree bottom-up from (key, offset) pairs supplied in sorted order
+ *
+ * Leaves are written first as one run of consecutive blocks (interleaved with the overflow blocks of
+ * a covering index), then each internal level is written above them, so the whole build is a single
+ * sequential pass over the index file. Only the first key, last key and address of every node of the
+ * level being built is held in memory.
+ *
+ * Nodes are filled to fill_factor of their capacity: 2*degree keys in format 1, block_size bytes in
+ * format 2. The last two nodes of each level are evened out so that only the root can be under-full.
+ *
+ * member variables:
+ * leaf_fill (int) - format 1: number of keys placed in each leaf
+ * fill_bytes (long) - format 2: number of bytes filled in each node
+ * leaf (Node *) - the leaf currently being filled, its block already allocated so the previous leaf can link to it
+ * held (Node *) - the previous full leaf, held back so the last two leaves can be balanced
+ * leaf_prefix (int) - length of the prefix shared by the keys in 'leaf' (tracks its format 2 size)
+ * leaf_payload_bytes (long) - bytes of the payloads in 'leaf' of a covering index
+ * leaf_min, leaf_max (long) - smallest and largest data file pointer in 'leaf' (tracks its format 3 size)
+ * level_first, level_last, level_addrs, level_counts (vector) - first key, last key, address and number of
+ * leaf entries below every node on the current level
+ */
+class BulkLoader
+{
+    public:
+    int leaf_fill;
+    long fill_bytes;
+    Node* leaf;
+    Node* held;
+    int leaf_prefix;
+    long leaf_payload_bytes;
+    long leaf_min, leaf_max;
+    vector<string> level_first;
+    vector<string> level_last;
+    vector<long> level_addrs;
+    vector<long> level_counts;
+
+    BulkLoader()
+    {
+        leaf_fill = fill_entries(2 * degree, degree);
+        fill_bytes = fill_factor * block_size;
+        leaf = new_leaf();
+        held = NULL;
+    }
+
+    /* number of entries to place in a format 1 node holding up to max_entries (never less than min_entries) */
+    int fill_entries(int max_entries, int min_entries)
+    {
+        int n = (int) (fill_factor * max_entries);
+        if (n < min_entries)
+            n = min_entries;
+        if (n > max_entries)
+            n = max_entries;
+        return n;
+    }
+
+    Node* new_leaf()
+    {
+        vector<string> k;
+        vector<long> v;
+        leaf_prefix = stored_key_len();
+        leaf_payload_bytes = 0;
+        leaf_min = leaf_max = -1;
+        Node* n = new Node(true, k, v, v);
+        n->address = buffer_pool.allocate();
+        return n;
+    }
+
+    /* whether the leaf being filled has reached its fill target before taking 'key', its data file
+     * pointer 'offset' and a payload of 'payload_len' bytes
+     */
+    bool leaf_full(const string &key, long offset, long payload_len)
+    {
+        long count = leaf->keys.size();
+        if (format_version == 1)
+            return count >= leaf_fill;
+        if (count == 0)
+            return false;
+
+        // format 2 leaf keys all have the stored length, so the size follows from the shared prefix
+        long prefix = min(leaf_prefix, common_prefix(leaf->keys[0], key));
+        long size = v2_header_size + prefix + (count + 1) * (stored_key_len() - prefix + sizeof(long));
+        if (format_version == 3)
+        {
+            vector<long> bounds = { min(leaf_min, offset), max(leaf_max, offset) };
+            long base;
+            size += packed_pointers_size(count + 1, pointer_width(bounds, base)) - (count + 1) * sizeof(long);
+        }
+        if (cover_len != 0)
+            size += 2 * (count + 2) + leaf_payload_bytes + payload_len;
+        return size > fill_bytes;
+    }
+
+    /* whether a node is below the minimum fill only the root is allowed */
+    bool under_full(Node* n)
+    {
+        if (format_version == 1)
+            return (int) n->keys.size() < degree;
+        return n->encoded_size() < fill_bytes / 2;
+    }
+
+    /* append the next pair in sorted order */
+    void add(const string &key, long offset)
+    {
+        string payload = cover_len != 0 ? encode_payload(offset) : "";
+        bloom.build_add(key);
+        if (leaf_full(key, offset, payload.length()))
+        {
+            if (held != NULL)
+                write_leaf(held, leaf->address);
+            held = leaf;
+            leaf = new_leaf();
+        }
+        if (!leaf->keys.empty())
+            leaf_prefix = min(leaf_prefix, common_prefix(leaf->keys[0], key));
+        leaf->keys.push_back(key);
+        leaf->pointers.push_back(offset);
+        leaf_min = leaf->pointers.size() == 1 ? offset : min(leaf_min, offset);
+        leaf_max = max(leaf_max, offset);
+        if (cover_len != 0)
+        {
+            leaf->payloads.push_back(payload);
+            leaf_payload_bytes += payload.length();
+        }
+    }
+
+    /* write out a leaf at its address, linked to its neighbours ('next' is -1 for the last leaf) */
+    void write_leaf(Node* n, long next)
+    {
+        n->prev = level_addrs.empty() || copy_on_write ? -1 : level_addrs.back();
+        n->next = copy_on_write ? -1 : next; // copy-on-write leaves aren't chained (see ShadowPaging)
+
+        level_first.push_back(n->keys.empty() ? "" : n->keys.front());
+        level_last.push_back(n->keys.empty() ? "" : n->keys.back());
+        level_addrs.push_back(n->address);
+        level_counts.push_back(n->keys.size());
+        n->write_to_disk();
+        delete n;
+    }
+
+    /* write the remaining leaves and every internal level above them
+     *
+     * output (long int) - the address of the root node
+     */
+    long finish()
+    {
+        if (held == NULL)
+        {
+            write_leaf(leaf, -1); // single (possibly empty) leaf is the root
+        }
+        else
+        {
+            // even out the last two leaves: merge them if they fit in one, otherwise split them in half
+            if (under_full(leaf))
+            {
+                long address = leaf->address;
+                held->keys.insert(held->keys.end(), leaf->keys.begin(), leaf->keys.end());
+                held->pointers.insert(held->pointers.end(), leaf->pointers.begin(), leaf->pointers.end());
+                held->payloads.insert(held->payloads.end(), leaf->payloads.begin(), leaf->payloads.end());
+                delete leaf;
+                leaf = NULL;
+                if (!node_fits(held))
+                {
+                    leaf = split_leaf_node(held);
+                    leaf->address = address;
+                }
+                else
+                    buffer_pool.release(address);
+            }
+
+            write_leaf(held, leaf != NULL ? leaf->address : -1);
+            if (leaf != NULL)
+                write_leaf(leaf, -1);
+        }
+
+        while (level_addrs.size() > 1)
+            write_index_level();
+        return level_addrs[0];
+    }
+
+    /* build the internal node over children [lo, hi) of the level below */
+    Node* index_node(const vector<string> &first, const vector<string> &last, const vector<long> &addrs,
+                     const vector<long> &counts, long lo, long hi)
+    {
+        vector<string> keys;
+        vector<long> v1;
+        for (long i = lo + 1 ; i < hi ; i++)
+            keys.push_back(separator_key(last[i - 1], first[i]));
+        vector<long> children(addrs.begin() + lo, addrs.begin() + hi);
+        Node* n = new Node(false, keys, v1, children);
+        if (n->has_counts())
+            n->counts.assign(counts.begin() + lo, counts.begin() + hi);
+        return n;
+    }
+
+    /* write one internal level above the level described by level_first/level_last/level_addrs/level_counts */
+    void write_index_level()
+    {
+        vector<string> first, last;
+        vector<long> addrs, counts;
+        first.swap(level_first);
+        last.swap(level_last);
+        addrs.swap(level_addrs);
+        counts.swap(level_counts);
+
+        // plan the children of each node: fill greedily, then even out the last two nodes
+        int fill_children = fill_entries(2 * degree + 1, degree + 1);
+        vector<long> bounds(1, 0);
+        long total = addrs.size();
+        while (bounds.back() < total)
+        {
+            long lo = bounds.back();
+            long hi = min(lo + 2, total);
+            while (hi < total)
+            {
+                if (format_version == 1 && hi - lo >= fill_children)
+                    break;
+                if (format_version != 1)
+                {
+                    Node* n = index_node(first, last, addrs, counts, lo, hi + 1);
+                    bool room = n->encoded_size() <= fill_bytes;
+                    delete n;
+                    if (!room)
+                        break;
+                }
+                hi++;
+            }
+            bounds.push_back(hi);
+        }
+
+        int nodes = bounds.size() - 1;
+        if (nodes >= 2)
+        {
+            long lo = bounds[nodes - 2], hi = bounds[nodes];
+            Node* tail = index_node(first, last, addrs, counts, bounds[nodes - 1], hi);
+            bool small = format_version == 1 ? (int) tail->children.size() < degree + 1 : under_full(tail);
+            delete tail;
+            if (small)
+            {
+                Node* merged = index_node(first, last, addrs, counts, lo, hi);
+                if (node_fits(merged))
+                    bounds.erase(bounds.end() - 2);
+                else
+                    bounds[nodes - 1] = hi - (hi - lo) / 2;
+                delete merged;
+            }
+        }
+
+        for (size_t i = 0 ; i + 1 < bounds.size() ; i++)
+        {
+            Node* index = index_node(first, last, addrs, counts, bounds[i], bounds[i + 1]);
+            long entries = index->entries();
+            index->write_to_disk(); // appends and assigns the node's address
+            level_first.push_back(first[bounds[i]]);
+            level_last.push_back(last[bounds[i + 1] - 1]);
+            level_addrs.push_back(index->address);
+            level_counts.push_back(entries);
+            delete index;
+        }
+    }
+};
+
+// worker threads used to read and sort the data file in -create (-threads option)
+int build_threads = 1;
+
+// memory budget in bytes for sorting the (key, offset) pairs in -create (-sortmem option, in MB);
+// data files with more pairs than fit are sorted in runs spilled to temporary files
+long sort_budget = 512L * 1024 * 1024;
+
+/* reads the key and offset of every line that starts in [begin, end) of the mapped data file and
+ * sorts them by key (and offset, so duplicate keys keep their data file order)
+ *
+ * input parameters:
+ * data (const char *) - the mapped data file, 'size' bytes long
+ * begin, end (long) - the chunk, both ends at the start of a line
+ * run (vector<pair<string, long>>) - gets the sorted (key, offset) pairs
+ */
+void scan_chunk(const char *data, long size, long begin, long end, vector<pair<string, long> > &run)
+{
+    long pos = begin;
+    while (pos < end)
+    {
+        const char *newline = (const char*) memchr(data + pos, '\n', size - pos);
+        long line_end = newline ? newline - data : size;
+        if (int_key_width > 0 && line_end == pos)
+        {
+            pos = line_end + 1; // an empty line has no key to store as an integer
+            continue;
+        }
+
+        // pad short keys with blanks the same way find_index() pads search keys
+        string key(data + pos, min((long) key_len, line_end - pos));
+        if ((int) key.length() < key_len)
+            key.append(key_len - key.length(), ' ');
+        if (int_key_width > 0 && !int_key(key, key))
+        {
+            cout << "The record at offset " << pos << " of " << data_filename << " doesn't start with "
+                 << int_key_digits << " digits, so its key can't be stored as an integer\n";
+            exit(1);
+        }
+        run.push_back(make_pair(key, pos));
+        pos = line_end + 1;
+    }
+    sort(run.begin(), run.end());
+}
+
+/* sorts the (key, offset) pairs of the lines in [begin, end) of the mapped data file with
+ * build_threads threads: the range is split into line-aligned chunks that are scanned and sorted
+ * concurrently, and the sorted runs are then merged pairwise, the pairs of each round in parallel
+ *
+ * input parameters:
+ * data (const char *) - the mapped data file, 'size' bytes long
+ * begin, end (long) - the range, both ends at the start of a line
+ * records (vector<pair<string, long>>) - gets the sorted pairs
+ */
+void sort_segment(const char *data, long size, long begin, long end, vector<pair<string, long> > &records)
+{
+    // chunk j starts at the first line that begins at or after j/threads of the range
+    int threads = max(1, build_threads);
+    vector<long> bounds(1, begin);
+    for (int j = 1 ; j < threads ; j++)
+    {
+        long pos = max(begin + (end - begin) * j / threads, bounds.back());
+        while (pos > begin && pos < end && data[pos - 1] != '\n')
+            pos++;
+        bounds.push_back(pos);
+    }
+    bounds.push_back(end);
+
+    vector<vector<pair<string, long> > > runs(threads);
+    vector<thread> workers;
+    for (int j = 0 ; j < threads ; j++)
+        workers.push_back(thread(scan_chunk, data, size, bounds[j], bounds[j + 1], ref(runs[j])));
+    for (thread &worker : workers)
+        worker.join();
+
+    // earlier chunks stay on the left of every merge, so equal keys keep their data file order
+    while (runs.size() > 1)
+    {
+        vector<vector<pair<string, long> > > merged((runs.size() + 1) / 2);
+        workers.clear();
+        for (size_t j = 0 ; j < merged.size() ; j++)
+        {
+            workers.push_back(thread([&runs, &merged, j]()
+            {
+                if (2 * j + 1 == runs.size())
+                {
+                    merged[j].swap(runs[2 * j]);
+                    return;
+                }
+                vector<pair<string, long> > &a = runs[2 * j];
+                vector<pair<string, long> > &b = runs[2 * j + 1];
+                merged[j].reserve(a.size() + b.size());
+                merge(make_move_iterator(a.begin()), make_move_iterator(a.end()),
+                      make_move_iterator(b.begin()), make_move_iterator(b.end()), back_inserter(merged[j]));
+                vector<pair<string, long> >().swap(a);
+                vector<pair<string, long> >().swap(b);
+            }));
+        }
+        for (thread &worker : workers)
+            worker.join();
+        runs.swap(merged);
+    }
+    records.swap(runs[0]);
+}
+
+/* class reading a sorted run file of fixed-size records (stored key bytes, 8 byte offset) through
+ * a buffer, one record at a time
+ *
+ * member variables:
+ * file (BlockDevice) - the run file
+ * buffer (vector<char>) - the records read ahead
+ * file_pos (long) - where the next buffer load starts in the file
+ * buffer_pos, buffer_len (long) - the current record and the end of the loaded records in 'buffer'
+ * done (bool) - whether every record has been consumed
+ */
+class RunReader
+{
+    public:
+    BlockDevice file;
+    vector<char> buffer;
+    long file_pos;
+    long buffer_pos;
+    long buffer_len;
+    bool done;
+
+    /* open the run and position it on its first record
+     *
+     * input parameters:
+     * name (string) - the run file
+     * buffer_size (long) - bytes to read ahead, rounded down to whole records
+     */
+    void open(const string &name, long buffer_size)
+    {
+        long record = stored_key_len() + sizeof(long);
+        buffer.resize(max(record, buffer_size / record * record));
+        file.open(name, false, false);
+        file_pos = 0;
+        buffer_pos = buffer_len = 0;
+        done = false;
+        next(); // loads the first part of the file
+    }
+
+    const char* key() const
+    {
+        return buffer.data() + buffer_pos;
+    }
+
+    long offset() const
+    {
+        long offset;
+        memcpy(&offset, buffer.data() + buffer_pos + stored_key_len(), sizeof(offset));
+        return offset;
+    }
+
+    /* step to the next record, loading the next part of the file when the buffer runs out */
+    void next()
+    {
+        long record = stored_key_len() + sizeof(long);
+        buffer_pos += record;
+        if (buffer_pos < buffer_len)
+            return;
+
+        long remaining = file.end_offset - file_pos;
+        buffer_len = min((long) buffer.size(), remaining);
+        if (buffer_len < record)
+        {
+            done = true;
+            return;
+        }
+        file.read_at(file_pos, buffer.data(), buffer_len);
+        file_pos += buffer_len;
+        buffer_pos = 0;
+    }
+};
+
+/* class picking the smallest head among k sorted runs with a tree of losers
+ *
+ * Every internal node holds the run that lost the comparison played there and tree[0] holds the
+ * overall winner, so replacing the winner's head costs one comparison per level (log2 k) on the
+ * path from its leaf to the root.
+ *
+ * member variables:
+ * runs (vector<RunReader> &) - the runs being merged; exhausted runs compare larger than any key
+ * tree (vector<int>) - tree[0] is the winning run, tree[1..k-1] the losers of each match
+ */
+class LoserTree
+{
+    public:
+    vector<RunReader> &runs;
+    vector<int> tree;
+
+    LoserTree(vector<RunReader> &r) : runs(r)
+    {
+        int k = runs.size();
+        tree.assign(max(k, 1), -1);
+        for (int s = k - 1 ; s >= 0 ; s--)
+            replay(s);
+    }
+
+    /* the run whose head is the smallest remaining record, or -1 when all runs are exhausted */
+    int winner() const
+    {
+        return runs.empty() || runs[tree[0]].done ? -1 : tree[0];
+    }
+
+    /* consume the winner's head and restore the tree */
+    void pop()
+    {
+        int s = tree[0];
+        runs[s].next();
+        replay(s);
+    }
+
+    private:
+    /* whether run a's head comes before run b's head (ties go to the earlier offset) */
+    bool beats(int a, int b) const
+    {
+        if (runs[a].done || runs[b].done)
+            return !runs[a].done;
+        int c = memcmp(runs[a].key(), runs[b].key(), stored_key_len());
+        if (c != 0)
+            return c < 0;
+        return runs[a].offset() < runs[b].offset();
+    }
+
+    /* play run s's head up from its leaf, leaving the loser of every match on the way behind */
+    void replay(int s)
+    {
+        int k = runs.size();
+        for (int t = (s + k) / 2 ; t > 0 ; t /= 2)
+        {
+            if (tree[t] == -1) // still being built: wait here for the other side
+            {
+                tree[t] = s;
+                return;
+            }
+            if (beats(tree[t], s))
+                swap(s, tree[t]);
+        }
+        tree[0] = s;
+    }
+};
+
+/* memory, disk and time used by sort_data_file() */
+struct SortReport
+{
+    double scan_time;  // reading, sorting and spilling the pairs
+    double merge_time; // handing the sorted pairs to the bulk loader
+    int runs;          // temporary run files written, 0 when everything was sorted in memory
+    int passes;        // merge passes over the runs before the one feeding the loader
+    long memory;       // peak bytes held by the sort
+    long disk;         // bytes written to temporary run files
+};
+
+// smallest read-ahead buffer worth giving a run while merging; the merge fan-in is capped so that
+// every run still gets this much of sort_budget
+const long min_run_buffer = 64L * 1024;
+
+/* merges the runs named in run_names[first, first + n) into one new run file, writing it through an
+ * output buffer the same size as each read-ahead buffer so the pass holds (n + 1) buffers
+ *
+ * input parameters:
+ * run_names (vector<string>) - the run files; the merged ones are deleted
+ * first (size_t) - the first run to merge
+ * n (size_t) - the number of runs to merge
+ * name (string) - the run file to write
+ * report (SortReport) - memory and disk are raised by what the pass uses
+ */
+void merge_run_group(const vector<string> &run_names, size_t first, size_t n, const string &name, SortReport &report)
+{
+    long buffer_size = max(min_run_buffer, sort_budget / (long) (n + 1));
+    vector<RunReader> runs(n);
+    for (size_t r = 0 ; r < n ; r++)
+        runs[r].open(run_names[first + r], buffer_size);
+    report.memory = max(report.memory, (long) (n + 1) * (long) runs[0].buffer.size());
+
+    BlockDevice run;
+    run.open(name, true, false);
+    long record = stored_key_len() + sizeof(long);
+    vector<char> buffer;
+    buffer.reserve(runs[0].buffer.size());
+    LoserTree tree(runs);
+    for (int s = tree.winner() ; s != -1 ; s = tree.winner())
+    {
+        buffer.insert(buffer.end(), runs[s].key(), runs[s].key() + record);
+        tree.pop();
+        if ((long) buffer.size() + record > (long) buffer.capacity())
+        {
+            run.append(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    if (!buffer.empty())
+        run.append(buffer.data(), buffer.size());
+    report.disk += run.end_offset;
+    run.close();
+    for (size_t r = 0 ; r < n ; r++)
+    {
+        runs[r].file.close();
+        unlink(run_names[first + r].c_str());
+    }
+}
+
+/* reads every (key, offset) pair of the data file and feeds them to 'loader' in sorted order
+ * using at most about sort_budget bytes: the file is cut into line-aligned segments whose pairs fit
+ * in the budget and each is sorted with sort_segment(). A file that fits in one segment goes
+ * straight to the loader; otherwise every sorted segment is written to a temporary run file next to
+ * the index and the runs are merged with a LoserTree while they are loaded. When there are too many
+ * runs for each to get min_run_buffer of the budget, groups of them are first merged into longer
+ * runs with merge_run_group(), as many passes as it takes.
+ *
+ * input parameters:
+ * loader (BulkLoader) - receives the sorted pairs
+ * report (SortReport) - filled with the resources used
+ *
+ * output (long int) - the number of pairs
+ */
+long sort_data_file(BulkLoader &loader, SortReport &report)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    report.runs = report.passes = 0;
+    report.memory = report.disk = 0;
+
+    long size = data_device.end_offset;
+    const char *data = NULL;
+    if (size > 0)
+    {
+        data = (const char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, data_device.fd, 0);
+        if (data == MAP_FAILED)
+        {
+            cout << "Cannot map data file " << data_filename << ": " << strerror(errno) << "\n";
+            exit(1);
+        }
+        madvise((void*) data, size, MADV_SEQUENTIAL);
+    }
+
+    // a pair costs its vector slot plus the key's heap buffer when it's too long for the string itself,
+    // and the pairwise merges briefly hold every pair twice
+    long pair_bytes = sizeof(pair<string, long>) + (stored_key_len() > 15 ? stored_key_len() + 1 : 0);
+    long segment_pairs = max(1L, sort_budget / (2 * pair_bytes));
+    long record = stored_key_len() + sizeof(long);
+
+    long count = 0;
+    vector<string> run_names;
+    vector<pair<string, long> > records;
+    long pos = 0;
+    while (pos < size)
+    {
+        // the segment ends after segment_pairs lines or at the end of the file
+        long end = pos;
+        for (long lines = 0 ; lines < segment_pairs && end < size ; lines++)
+        {
+            const char *newline = (const char*) memchr(data + end, '\n', size - end);
+            end = newline ? newline - data + 1 : size;
+        }
+
+        sort_segment(data, size, pos, end, records);
+        count += records.size();
+        report.memory = max(report.memory, (long) records.size() * pair_bytes * (build_threads > 1 ? 2 : 1));
+        madvise((void*) (data + pos - pos % getpagesize()), end - pos + pos % getpagesize(), MADV_DONTNEED);
+        pos = end;
+        if (pos == size && run_names.empty())
+            break; // everything fit in memory
+
+        string name = index_filename + ".run" + to_string(run_names.size());
+        BlockDevice run;
+        run.open(name, true, false);
+        vector<char> buffer;
+        buffer.reserve(min((long) records.size(), 65536L) * record);
+        for (size_t r = 0 ; r < records.size() ; r++)
+        {
+            buffer.insert(buffer.end(), records[r].first.begin(), records[r].first.end());
+            buffer.insert(buffer.end(), (char*) &records[r].second, (char*) &records[r].second + sizeof(long));
+            if ((long) buffer.size() >= 65536 * record || r + 1 == records.size())
+            {
+                run.append(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+        }
+        report.disk += run.end_offset;
+        run.close();
+        run_names.push_back(name);
+        vector<pair<string, long> >().swap(records);
+    }
+    if (data != NULL)
+        munmap((void*) data, size);
+
+    chrono::steady_clock::time_point sorted = chrono::steady_clock::now();
+    report.runs = run_names.size();
+
+    // the number of keys is known now, so the Bloom filter is sized before the first one is loaded and
+    // its bits are set as the keys stream into the loader
+    long filter;
+    if (run_names.empty())
+    {
+        filter = bloom.begin_build(count);
+        report.memory = max(report.memory, (long) records.size() * pair_bytes + filter);
+        for (const pair<string, long> &entry : records)
+            loader.add(entry.first, entry.second);
+    }
+    else
+    {
+        // a pass merges at most fan_in runs so that each keeps min_run_buffer of the budget (plus
+        // one buffer for the merged output); passes repeat until the last merge fits the budget
+        size_t fan_in = max(2L, sort_budget / min_run_buffer - 1);
+        int generation = 0;
+        while (run_names.size() > fan_in)
+        {
+            vector<string> merged;
+            for (size_t first = 0 ; first < run_names.size() ; first += fan_in)
+            {
+                size_t n = min(fan_in, run_names.size() - first);
+                if (n == 1)
+                {
+                    merged.push_back(run_names[first]);
+                    continue;
+                }
+                string name = index_filename + ".run" + to_string(++generation) + "." + to_string(merged.size());
+                merge_run_group(run_names, first, n, name, report);
+                merged.push_back(name);
+            }
+            run_names.swap(merged);
+            report.passes++;
+        }
+
+        // what the filter leaves of the budget is shared out as read-ahead buffers, one per run
+        filter = bloom.begin_build(count);
+        long buffer_size = max(min_run_buffer, (sort_budget - filter) / (long) run_names.size());
+        vector<RunReader> runs(run_names.size());
+        for (size_t r = 0 ; r < runs.size() ; r++)
+            runs[r].open(run_names[r], buffer_size);
+        report.memory = max(report.memory, (long) runs.size() * (long) runs[0].buffer.size() + filter);
+
+        LoserTree tree(runs);
+        for (int s = tree.winner() ; s != -1 ; s = tree.winner())
+        {
+            loader.add(string(runs[s].key(), stored_key_len()), runs[s].offset());
+            tree.pop();
+        }
+        for (size_t r = 0 ; r < runs.size() ; r++)
+        {
+            runs[r].file.close();
+            unlink(run_names[r].c_str());
+        }
+    }
+
+    report.scan_time = chrono::duration<double>(sorted - start).count();
+    report.merge_time = chrono::duration<double>(chrono::steady_clock::now() - sorted).count();
+    return count;
+}
+
+/* fingerprint of the data file up to 'end': a hash of its length and of 64 blocks spread evenly
+ * from its start to just before 'end' (all of it when it is that small), so -sync notices a file that
+ * was rewritten or truncated rather than appended to. A change that leaves the length and every
+ * sampled block as they were goes unnoticed
+ *
+ * output (unsigned long int) - the fingerprint
+ */
+unsigned long data_fingerprint(long end)
+{
+    const long span = 4096;
+    const long samples = 64;
+    char buf[span];
+    unsigned long hash = fnv1a((const char*) &end, sizeof(end));
+    long last = max(0L, end - span);
+    long count = min(samples, (last + span - 1) / span + 1);
+    for (long i = 0; i < count; i++)
+    {
+        // evenly spaced from offset 0 to the block ending at 'end', where appended lines start
+        long start = count > 1 ? last * i / (count - 1) : 0;
+        long got = data_device.read_at(start, buf, min(span, end - start));
+        hash = fnv1a(buf, got, hash);
+    }
+    return hash;
+}
+
+/* set up integer key mode for a new index from the first key of the data file: its leading digits
+ * are the digits every key must start with
+ *
+ * output (bool) - false (with a message) if the keys can't be stored as integers
+ */
+bool detect_int_keys()
+{
+    char first[key_len];
+    long got = data_device.read_at(0, first, key_len);
+    int digits = 0;
+    while (digits < got && first[digits] >= '0' && first[digits] <= '9')
+        digits++;
+    if (digits == 0)
+    {
+        cout << "Integer keys must start with a digit, but the first key of " << data_filename << " doesn't\n";
+        return false;
+    }
+    int_key_digits = digits;
+    int_key_width = int_key_bytes(digits);
+    if (int_key_width == 0)
+    {
+        cout << "Keys of " << digits << " digits and " << key_len - digits << " other bytes don't fit in 128 bits\n";
+        int_key_digits = 0;
+        return false;
+    }
+    return true;
+}
+
+/* create or update an index file and the first metadata block at position 0
+ *
+ * input parameters:
+ * data_file (string) - the file containing all the records to insert
+ * index_file (string) - the index file that will store bplus tree key + offsets
+ * keylen (int) - the key length of the file
+ * new_root_address (long int) - the root address to be written - used only if the global root_address is not initialized
+ * update_flag (bool) - specifies whether we are creating the index for the first time or just updating it
+ *
+ * output (void) - creates or updates the index. A new index is bulk loaded: all (key, offset) pairs are
+ * sorted and the tree is written bottom-up with nodes filled to fill_factor.
+ */
+void create_index(string data_file, string index_file, int keylen, long new_root_address, bool update_flag=false)
+{
+    /* create index file with one metadata block of block_size bytes
+     * structure:
+     * data filename (256 bytes)
+     * key length (4 bytes - int)
+     * degree (4 bytes - int)
+     * root_address (8 bytes - long)
+     * magic number (4 bytes - int)
+     * format version (4 bytes - int)
+     * block size (4 bytes - int)
+     * covered byte range of each record (2 x 4 bytes - int, see cover_len)
+     * Bloom filter address and number of lines (2 x 8 bytes - long, see BloomFilter)
+     * indexed end of the data file (8 bytes - long) and its fingerprint (8 bytes, see synced_end)
+     * integer key digits and stored width (2 x 4 bytes - int, see int_key_width)
+     * the two commit records of a copy-on-write index at the end of each half of the first
+     * metadata_size bytes (see ShadowPaging)
+     */
+    long offset = 0;
+    char buffer[block_size];
+    memset(buffer, 0, block_size);
+
+    // write filename in first 256 bytes
+    string filename = data_file.append(string((256 - data_file.length()), '0'));
+    memcpy(buffer + offset, filename.c_str(), strlen(filename.c_str()) + 1);
+    offset += strlen(filename.c_str()) + 1;
+
+    // write keylen
+    memcpy(buffer + offset, &keylen, sizeof(keylen));
+    offset += sizeof(keylen);
+
+    // calculate degree of a node (a node can store degree <= n <= 2*degree key-value pairs)
+    // assume 50 bytes for metadata (on the safe side)
+    // the exact number of bytes used in a block apart from records = 25 bytes (3 longs and a bool)
+    int degree = (block_size - 50)/ ((keylen+1+8)*2); // each record is key_length bytes + '\0' + 8 bytes for a long
+    if (degree < 1)
+    {
+        cout << "Key length too large for a " << block_size << " byte block\n";
+        return;
+    }
+
+    // write degree
+    memcpy(buffer + offset, &degree, sizeof(degree));
+    offset += sizeof(degree);
+
+    // write root address with default as the block after the metadata otherwise use the global variable value
+    if (new_root_address == -1) 
+    {
+        new_root_address = block_size;
+        root_address = block_size;
+    }
+    memcpy(buffer + offset, &new_root_address, sizeof(new_root_address));
+    offset += sizeof(new_root_address);
+
+    // write the node format
+    memcpy(buffer + offset, &index_magic, sizeof(index_magic));
+    offset += sizeof(index_magic);
+    memcpy(buffer + offset, &format_version, sizeof(format_version));
+    offset += sizeof(format_version);
+
+    // write the block size
+    memcpy(buffer + offset, &block_size, sizeof(block_size));
+    offset += sizeof(block_size);
+
+    // write the covered byte range
+    memcpy(buffer + offset, &cover_start, sizeof(cover_start));
+    offset += sizeof(cover_start);
+    memcpy(buffer + offset, &cover_len, sizeof(cover_len));
+    offset += sizeof(cover_len);
+
+    // write the Bloom filter location
+    memcpy(buffer + offset, &bloom.address, sizeof(bloom.address));
+    offset += sizeof(bloom.address);
+    memcpy(buffer + offset, &bloom.lines, sizeof(bloom.lines));
+    offset += sizeof(bloom.lines);
+
+    // write the indexed end of the data file and its fingerprint
+    memcpy(buffer + offset, &synced_end, sizeof(synced_end));
+    offset += sizeof(synced_end);
+    memcpy(buffer + offset, &synced_fingerprint, sizeof(synced_fingerprint));
+    offset += sizeof(synced_fingerprint);
+
+    // write the integer key mode
+    memcpy(buffer + offset, &int_key_digits, sizeof(int_key_digits));
+    offset += sizeof(int_key_digits);
+    memcpy(buffer + offset, &int_key_width, sizeof(int_key_width));
+    offset += sizeof(int_key_width);
+
+    // write the commit records
+    for (int s = 0 ; s < 2 ; s++)
+        memcpy(buffer + ShadowPaging::record_offset(s), shadow.records[s], ShadowPaging::record_size);
+
+    // copy buffer to file
+    // the index file is already open when we're updating it
+    // but is created (or truncated) when we're creating it for the first time
+    if (!index_device.open(index_file, !update_flag, use_direct_io))
+    {
+        cout << "Cannot create index file " << index_file << "\n";
+        return;
+    }
+    index_device.write_at(0, buffer, block_size);
+
+    if (update_flag) // if this was just an update then no need to insert everything again
+        return;
+
+    // a redo log or reader table left by an earlier index of the same name no longer applies
+    unlink(WriteAheadLog::log_name(index_file).c_str());
+    unlink(ShadowPaging::table_name(index_file).c_str());
+
+    // initialize the root of the bplus tree
+    index_filename = index_file;
+    initialize_bplus_tree();
+
+    // read every (key, offset) pair from the data file in sorted order and build the tree bottom-up
+    if (int_keys && !detect_int_keys())
+    {
+        index_device.close();
+        unlink(index_file.c_str());
+        return;
+    }
+    BulkLoader loader;
+    SortReport report;
+    synced_end = data_device.end_offset;
+    synced_fingerprint = data_fingerprint(synced_end);
+    long count = sort_data_file(loader, report);
+
+    chrono::steady_clock::time_point write_start = chrono::steady_clock::now();
+    root_address = loader.finish();
+    bloom.end_build();
+    buffer_pool.flush(); // the tree is complete on disk before the metadata points at its root
+    if (copy_on_write)
+        shadow.start();
+    update_metadata();
+    double write_time = chrono::duration<double>(chrono::steady_clock::now() - write_start).count();
+
+    cout << "Successfully inserted " << count << " records in index file b+ tree." << endl;
+    cout << fixed << setprecision(3) << "Build stages (" << max(1, build_threads) << " threads): scan and sort "
+         << report.scan_time << "s, merge " << report.merge_time << "s, write " << write_time << "s" << endl;
+    cout << setprecision(1) << "Sort: " << report.memory / 1048576.0 << " MB memory, ";
+    if (report.runs == 0)
+        cout << "no temporary files" << endl;
+    else
+        cout << report.runs << " runs in " << report.disk / 1048576.0 << " MB of temporary files, "
+             << report.passes << " extra merge passes" << endl;
+}
+
+/* if key supplied is longer than key_len, truncate it or pad it with blanks */
+string pad_key(string key)
+{
+    if (key.length() > key_len) 
+        key = key.substr(0, key_len);
+    else if (key.length() < key_len)
+        key.append(key_len - key.length(), ' ');
+    return key;
+}
+
+/* the form of a key given on the command line or in a request that the index is searched with
+ * (see int_search_key() for integer key mode)
+ *
+ * input parameters:
+ * exact (bool) - set to false if no key of the index can equal 'key'
+ */
+string search_form(const string &key, bool &exact)
+{
+    exact = true;
+    return int_key_width > 0 ? int_search_key(key, exact) : key;
+}
+
+/* find an exact target key in the open index and print its record or a message if not found
+ *
+ * input parameters:
+ * target_key (string) - the key to search for
+ * out (ostream) - where the record is printed
+ */
+void find_key(string target_key, ostream &out)
+{
+    bool exact;
+    target_key = search_form(pad_key(target_key), exact);
+    if (!exact)
+    {
+        out << "Cannot find specified record in index.\n";
+        return;
+    }
+
+    if (use_mmap)
+    {
+        MappedIndex mapped;
+        if (!mapped.open())
+        {
+            out << "Cannot map index file " << index_filename << "\n";
+            return;
+        }
+        string payload;
+        long key_offset = find_record_mapped(mapped, target_key.c_str(), target_key.length(), &payload);
+        if (key_offset == -1)
+            out << "Cannot find specified record in index.\n";
+        else if (cover_len != 0)
+            out << payload << "\n";
+        else
+            mapped.print_record(key_offset, out);
+        return;
+    }
+
+    string payload;
+    long key_offset = find_record(target_key, &payload);
+    if (key_offset == -1)
+        out << "Cannot find specified record in index.\n";
+    else if (cover_len != 0)
+        out << payload << "\n"; // a covering index answers without reading the data file
+    else
+        print_record_at_offset(key_offset, out);
+}
+
+/* find an exact target key in the specified index file and print its offset or a message if not found
+ *
+ * input parameters:
+ * index_file (string) - the index file we will search through
+ * target_key (string) - the key to search for
+ *
+ * output (void) -finds the record
+ */
+void find_index(string index_file, string target_key)
+{
+    index_filename = index_file;
+    initialize_bplus_tree();
+    // TODO - check if empty index file then return -1
+
+    find_key(target_key, cout);
+}
+
+/* the entries of a batch whose keys the Bloom filter doesn't rule out (the only ones worth looking up) */
+vector<pair<string, long> > filter_batch(const vector<pair<string, long> > &batch)
+{
+    vector<pair<string, long> > kept;
+    for (const pair<string, long> &entry : batch)
+    {
+        if (bloom.may_contain(entry.first))
+            kept.push_back(entry);
+    }
+    return kept;
+}
+
+/* resolve the run [lo, hi) of sorted batch keys that all land in leaf 'n'
+ *
+ * input parameters:
+ * n (NodeView) - the leaf
+ * batch (vector<pair<string, long>>) - (key, position in the input) pairs sorted by key
+ * lo, hi (long int) - the run of batch that routes into this leaf
+ * results (vector<long>) - data file offset found for each input position (-1 if not found)
+ * payloads (vector<string> *) - if given and the index is covering, covered bytes found for each input position
+ */
+void resolve_batch_in_leaf(const NodeView &n, const vector<pair<string, long> > &batch, long lo, long hi, vector<long> &results,
+                           vector<string> *payloads)
+{
+    for (long i = lo ; i < hi ; i++)
+    {
+        const string &key = batch[i].first;
+        int idx = n.lower_bound(key.c_str(), key.length());
+        if (idx < n.count() && n.compare_at(idx, key.c_str(), key.length()) == 0)
+        {
+            results[batch[i].second] = n.value(idx);
+            if (payloads != NULL && cover_len != 0)
+            {
+                long len;
+                const char *encoded = n.payload(idx, len);
+                (*payloads)[batch[i].second] = decode_payload(encoded, len);
             }
-        } 
-        else // leaf node - read pointers
+        }
+    }
+}
+
+/* split the run [lo, hi) of sorted batch keys reaching internal node 'n' into consecutive groups
+ * that route to the same child
+ *
+ * output (void) - group g goes to group_child[g] and covers [group_start[g], group_start[g + 1])
+ */
+void route_batch(const NodeView &n, const vector<pair<string, long> > &batch, long lo, long hi,
+                 vector<long> &group_child, vector<long> &group_start)
+{
+    for (long i = lo ; i < hi ; i++)
+    {
+        long child = n.value(n.upper_bound(batch[i].first.c_str(), batch[i].first.length()));
+        if (group_child.empty() || group_child.back() != child)
         {
-            pointers.clear();
-            for (long i = 0 ; i < keys_size ; i++) 
+            group_child.push_back(child);
+            group_start.push_back(i);
+        }
+    }
+    group_start.push_back(hi);
+}
+
+/* resolve a sorted run of batch keys inside the subtree rooted at 'address', reading each node once
+ *
+ * input parameters:
+ * address (long int) - root of the subtree
+ * the rest as in resolve_batch_in_leaf()
+ */
+void find_batch_in_subtree(long address, const vector<pair<string, long> > &batch, long lo, long hi, vector<long> &results,
+                           vector<string> *payloads = NULL)
+{
+    NodeView n(buffer_pool.pin(address));
+    if (n.is_leaf())
+    {
+        // all keys of the run land in this leaf and are resolved together
+        resolve_batch_in_leaf(n, batch, lo, hi, results, payloads);
+        buffer_pool.unpin(address, false);
+        return;
+    }
+
+    vector<long> group_child;
+    vector<long> group_start;
+    route_batch(n, batch, lo, hi, group_child, group_start);
+    buffer_pool.unpin(address, false);
+
+    for (size_t g = 0 ; g < group_child.size() ; g++)
+        find_batch_in_subtree(group_child[g], batch, group_start[g], group_start[g + 1], results, payloads);
+}
+
+/* find_batch_in_subtree() from the root with every node read of the walk going through io_engine
+ *
+ * Instead of descending one subtree after the other, every node the walk has reached is read at
+ * once (up to the engine depth), and each node is resolved as soon as its block arrives, queueing
+ * reads for the children its keys route to. A subtree whose blocks are cached is walked without
+ * waiting for anything. With the internal levels pinned, only the leaves are read.
+ */
+void find_batch_async(const vector<pair<string, long> > &batch, vector<long> &results, vector<string> *payloads)
+{
+    struct Visit
+    {
+        long address;
+        long lo, hi;
+    };
+    deque<Visit> waiting;
+    vector<Visit> issued; // node reads handed to the engine, indexed by tag
+
+    // with the internal levels pinned the walk starts at the leaves
+    vector<long> leaves;
+    if (inner_levels.route_batch(batch, leaves))
+    {
+        for (long i = 0, start = 0 ; i < (long) batch.size() ; i++)
+        {
+            if (i + 1 == (long) batch.size() || leaves[i + 1] != leaves[i])
+            {
+                waiting.push_back({ leaves[i], start, i + 1 });
+                start = i + 1;
+            }
+        }
+    }
+    else
+        waiting.push_back({ root_address, 0, (long) batch.size() });
+
+    // every read in flight holds a frame, so leave most of the pool to cached blocks
+    int limit = max(1, min(io_engine.depth, buffer_pool.capacity / 4));
+    int in_flight = 0;
+
+    // resolve the node of 'v' held in 'block', queueing its children
+    auto visit = [&](const Visit &v, const char *block)
+    {
+        NodeView n(block);
+        if (n.is_leaf())
+        {
+            resolve_batch_in_leaf(n, batch, v.lo, v.hi, results, payloads);
+            return;
+        }
+        vector<long> group_child;
+        vector<long> group_start;
+        route_batch(n, batch, v.lo, v.hi, group_child, group_start);
+        for (size_t g = 0 ; g < group_child.size() ; g++)
+            waiting.push_back({ group_child[g], group_start[g], group_start[g + 1] });
+    };
+
+    while (!waiting.empty() || in_flight > 0)
+    {
+        while (!waiting.empty() && in_flight < limit)
+        {
+            Visit v = waiting.front();
+            waiting.pop_front();
+            bool cached;
+            char *block = buffer_pool.pin_for_read(v.address, cached);
+            if (cached)
+            {
+                visit(v, block);
+                buffer_pool.unpin(v.address, false);
+                continue;
+            }
+            io_engine.read(index_device, block, block_size, v.address, issued.size());
+            issued.push_back(v);
+            in_flight++;
+        }
+        io_engine.submit();
+        if (in_flight == 0)
+            continue;
+
+        long bytes = 0;
+        long tag = io_engine.wait(bytes);
+        if (tag == -1)
+        {
+            cout << "I/O engine lost " << in_flight << " node reads\n";
+            exit(1);
+        }
+        in_flight--;
+        const Visit &v = issued[tag];
+        char *block = buffer_pool.filled(v.address);
+        visit(v, block);
+        buffer_pool.unpin(v.address, false);
+    }
+}
+
+/* find every key of a batch and write the matching records to 'out' in input order
+ *
+ * input parameters:
+ * batch (vector<pair<string, long>>) - (padded key, position in the input) pairs sorted by key
+ * lines (long int) - number of keys in the input
+ */
+void find_batch_keys(const vector<pair<string, long> > &batch, long lines, ostream &out)
+{
+    lock_guard<mutex> guard(io_engine.owner);
+    io_engine.start();
+    Snapshot snapshot; // every key is looked up in the same tree
+    vector<long> results(lines, -1);
+    vector<string> payloads(lines);
+    vector<pair<string, long> > candidates = filter_batch(batch);
+    if (!candidates.empty())
+        find_batch_async(candidates, results, &payloads);
+
+    vector<long> found;
+    vector<string> records;
+    if (cover_len == 0)
+    {
+        for (size_t i = 0 ; i < results.size() ; i++)
+        {
+            if (results[i] != -1)
+                found.push_back(results[i]);
+        }
+        fetch_records(found, records);
+    }
+
+    BufferedWriter writer(out);
+    long next = 0;
+    for (size_t i = 0 ; i < results.size() ; i++)
+    {
+        if (results[i] == -1)
+            writer.put("Cannot find specified record in index.\n");
+        else if (cover_len != 0)
+            writer.put(payloads[i] + "\n");
+        else
+            writer.put(records[next++] + "\n");
+    }
+}
+
+/* read the keys listed in a file (one per line, "-" for standard input)
+ *
+ * output (bool) - false after printing an error if the file cannot be opened; batch is filled with
+ *                 (padded key, position in the input) pairs sorted by key, for the keys of the
+ *                 'lines' lines read that can be in the index
+ */
+bool read_batch_keys(string keys_file, vector<pair<string, long> > &batch, long &lines)
+{
+    ifstream infile;
+    if (keys_file.compare("-") != 0)
+    {
+        infile.open(keys_file);
+        if (!infile)
+        {
+            cout << "Cannot open keys file " << keys_file << "\n";
+            return false;
+        }
+    }
+    istream &in = keys_file.compare("-") == 0 ? cin : infile;
+
+    string line;
+    bool exact;
+    for (lines = 0 ; getline(in, line) ; lines++)
+    {
+        string key = search_form(pad_key(line), exact);
+        if (exact) // the others can't be found
+            batch.push_back(make_pair(key, lines));
+    }
+    sort(batch.begin(), batch.end());
+    return true;
+}
+
+/* find every key listed in a file (one per line, "-" for standard input) and print the matching records
+ * in input order
+ *
+ * The keys are sorted and resolved in one walk of the tree, so keys that share a subtree share its
+ * internal node reads and keys that land in the same leaf are resolved together. The node reads of
+ * the walk and the record reads behind the found keys go through io_engine, which keeps many of
+ * them in flight at once.
+ *
+ * input parameters:
+ * index_file (string) - the index file we will search through
+ * keys_file (string) - file holding the keys to look up
+ *
+ * output: void (prints one record or not-found message per input key)
+ */
+void find_batch(string index_file, string keys_file)
+{
+    index_filename = index_file;
+    initialize_bplus_tree();
+
+    vector<pair<string, long> > batch;
+    long lines;
+    if (read_batch_keys(keys_file, batch, lines))
+        find_batch_keys(batch, lines, cout);
+}
+
+// inserts since the last commit_inserts(); -serve sets defer_commit to commit once per batch of requests
+long uncommitted_inserts = 0;
+bool defer_commit = false;
+
+// end of the data file before the first record appended since the last commit_inserts(), -1 if none was
+long uncommitted_start = -1;
+
+/* makes the inserts since the last commit durable
+ * without the redo log the changed blocks are written back to the index file as before; with it the
+ * data file is synced and the changed blocks are appended to the log in one group with one sync,
+ * followed by a checkpoint once the log has grown past its limit.
+ * when the appended records start at synced_end, the sync mark moves past them with the commit, so
+ * -sync doesn't read them again; with the redo log it reaches the metadata block at the checkpoint
+ */
+void commit_inserts()
+{
+    uncommitted_inserts = 0;
+    bool advance = uncommitted_start != -1 && uncommitted_start == synced_end;
+    uncommitted_start = -1;
+    if (shadow.active)
+    {
+        if (advance)
+        {
+            synced_end = data_device.end_offset;
+            synced_fingerprint = data_fingerprint(synced_end);
+        }
+        shadow.commit(advance); // the new synced end is written with the commit record
+        return;
+    }
+    if (!wal.active)
+    {
+        buffer_pool.flush(); // the tree is complete on disk before the metadata covers the new records
+        if (advance)
+        {
+            synced_end = data_device.end_offset;
+            synced_fingerprint = data_fingerprint(synced_end);
+            update_metadata();
+        }
+        return;
+    }
+
+    data_device.sync();
+    buffer_pool.log_changes(root_address);
+    if (advance)
+    {
+        synced_end = data_device.end_offset;
+        synced_fingerprint = data_fingerprint(synced_end);
+    }
+    if (wal.device.end_offset >= wal.checkpoint_bytes)
+        checkpoint();
+}
+
+// serializes inserts: a single writer at a time appends to the data file and modifies the tree,
+// while any number of threads look keys up
+mutex writer_latch;
+
+/* inserts a new record into the open index: first append it to the data file, then insert its key
+ *
+ * input parameters:
+ * initial_key (string) - the record to insert, starting with its key
+ * out (ostream) - where progress and errors are printed
+ */
+void insert_line(string initial_key, ostream &out)
+{
+    if (key_len > initial_key.length())
+    {
+        out << "Input Error: key supplied is too short\n";
+        return;
+    }
+    string key = initial_key.substr(0, key_len);
+    if (int_key_width > 0 && !int_key(key, key))
+    {
+        out << "Input Error: key doesn't start with the " << int_key_digits << " digits of this index's keys\n";
+        return;
+    }
+    lock_guard<mutex> guard(writer_latch);
+    shadow.begin(); // a copy-on-write index takes in other processes' commits first
+
+    // if key doesn't exist in index file, first insert record in data file then insert that key+its offset in bptree
+    if (find_record(key) != -1)
+    {
+        out << "Key already exists in the index.\n";
+        if (!defer_commit)
+            shadow.commit(); // nothing to commit, only lets other writers in
+        return;
+    }
+
+    // append record at the end of the data file and then insert normally into index
+    long key_offset = data_device.end_offset;
+    initial_key = "\n" + initial_key;
+
+    out << "Inserting \"" << initial_key << "\" at line number: " << key_offset << endl;
+
+    if (uncommitted_start == -1)
+        uncommitted_start = key_offset;
+    data_device.append(initial_key.c_str(), initial_key.length());
+    insert_key(key, key_offset + 1); // add 1 to account for newline
+    uncommitted_inserts++;
+
+    // changed blocks stay in the pool until they are logged, so a long batch commits early
+    if (!defer_commit || buffer_pool.unlogged > buffer_pool.capacity / 2)
+        commit_inserts();
+}
+
+/* inserts a new string into the specified index file
+ * first insert this record in the data file before inserting its pointer in the index file
+ *
+ * input parameters:
+ * index_file (string) - the index file we will search through
+ * initial_key (string) - the key to insert
+ *
+ * output: void (inserts the record)
+ */
+void insert_record(string index_file, string initial_key)
+{
+    index_filename = index_file;
+    initialize_bplus_tree();
+
+    insert_line(initial_key, cout);
+}
+
+/* a new right sibling made by dividing a node: the separator in front of it, its address and the
+ * number of leaf entries below it
+ */
+struct Split
+{
+    string key;
+    long address;
+    long entries;
+};
+
+/* merges sorted new entries into the subtree rooted at 'node', writing every affected node once
+ * entries are routed to the children the way a single insert would route them; a node that
+ * overflows is divided evenly into as many nodes as needed and the new ones are handed to the parent
+ *
+ * input parameters:
+ * node (Node *) - root of the subtree, already read
+ * entries (vector<pair<string, long>>) - (key, data file offset) pairs sorted by key, none of them in the tree
+ * lo, hi (long int) - the run [lo, hi) of entries that routes into this subtree
+ * splits (vector<Split>) - gets every new right sibling of 'node'
+ *
+ * output (long int) - the number of leaf entries left below 'node' (format 3 entry counts)
+ */
+long merge_into_subtree(Node* node, const vector<pair<string, long> > &entries, long lo, long hi, vector<Split> &splits)
+{
+    if (node->is_leaf)
+    {
+        vector<string> keys;
+        vector<long> pointers;
+        vector<string> payloads;
+        long i = lo;
+        for (size_t k = 0 ; k <= node->keys.size() ; k++)
+        {
+            while (i < hi && (k == node->keys.size() || entries[i].first < node->keys[k]))
+            {
+                keys.push_back(entries[i].first);
+                pointers.push_back(entries[i].second);
+                if (cover_len != 0)
+                    payloads.push_back(encode_payload(entries[i].second));
+                i++;
+            }
+            if (k < node->keys.size())
+            {
+                keys.push_back(node->keys[k]);
+                pointers.push_back(node->pointers[k]);
+                if (cover_len != 0)
+                    payloads.push_back(node->payloads[k]);
+            }
+        }
+        node->keys = keys;
+        node->pointers = pointers;
+        node->payloads = payloads;
+    }
+    else
+    {
+        // child c takes the keys below keys[c]; the new siblings of a child go in right after it
+        vector<string> keys;
+        vector<long> children;
+        vector<long> counts;
+        long i = lo;
+        for (size_t c = 0 ; c < node->children.size() ; c++)
+        {
+            if (c > 0)
+                keys.push_back(node->keys[c - 1]);
+            children.push_back(node->children[c]);
+
+            long end = i;
+            while (end < hi && (c == node->keys.size() || entries[end].first < node->keys[c]))
+                end++;
+            if (end == i)
+            {
+                if (node->has_counts())
+                    counts.push_back(node->counts[c]);
+                continue;
+            }
+
+            Node child(node->children[c]);
+            vector<Split> child_splits;
+            long child_entries = merge_into_subtree(&child, entries, i, end, child_splits);
+            children.back() = child.address; // moved by a copy-on-write index
+            if (node->has_counts())
+                counts.push_back(child_entries);
+            for (const Split &split : child_splits)
+            {
+                keys.push_back(split.key);
+                children.push_back(split.address);
+                if (node->has_counts())
+                    counts.push_back(split.entries);
+            }
+            i = end;
+        }
+        node->keys = keys;
+        node->children = children;
+        node->counts = counts;
+    }
+
+    if (node_fits(node))
+    {
+        long total = node->entries();
+        node->write_to_disk();
+        return total;
+    }
+
+    vector<string> separators;
+    vector<Node*> pieces = split_node_evenly(node, separators);
+    for (Node* piece : pieces)
+        piece->address = shadow.active ? shadow.allocate() : buffer_pool.allocate();
+
+    if (node->is_leaf && !shadow.active) // the leaves of a copy-on-write index aren't chained
+    {
+        // chain the pieces between the leaf and its old next sibling
+        long old_next = node->next;
+        Node* left = node;
+        for (Node* piece : pieces)
+        {
+            piece->prev = left->address;
+            left->next = piece->address;
+            left = piece;
+        }
+        left->next = old_next;
+        if (old_next != -1)
+        {
+            Node next(old_next);
+            next.prev = left->address;
+            next.write_to_disk();
+        }
+    }
+
+    for (size_t j = 0 ; j < pieces.size() ; j++)
+    {
+        splits.push_back({ separators[j], pieces[j]->address, pieces[j]->entries() }); // before write_to_disk() clears it
+        pieces[j]->write_to_disk();
+        delete pieces[j];
+    }
+    long total = node->entries();
+    node->write_to_disk();
+    return total;
+}
+
+/* sort a batch of (key, position) pairs and keep the first entry of every key the index doesn't have yet
+ *
+ * input parameters:
+ * batch (vector<pair<string, long>>) - the pairs, positions 0 to batch.size() - 1
+ * repeated (long int) - set to the number of entries dropped because their key came earlier in the batch
+ *
+ * output (vector<pair<string, long>>) - the kept pairs in key order
+ */
+vector<pair<string, long> > unindexed_keys(vector<pair<string, long> > batch, long &repeated)
+{
+    vector<long> existing(batch.size(), -1);
+    sort(batch.begin(), batch.end());
+    repeated = batch.size();
+    batch.erase(unique(batch.begin(), batch.end(),
+                       [](const pair<string, long> &a, const pair<string, long> &b) { return a.first == b.first; }),
+                batch.end());
+    repeated -= batch.size();
+
+    vector<pair<string, long> > candidates = filter_batch(batch);
+    if (!candidates.empty())
+        find_batch_in_subtree(root_address, candidates, 0, candidates.size(), existing);
+
+    vector<pair<string, long> > kept;
+    for (const pair<string, long> &entry : batch)
+    {
+        if (existing[entry.second] == -1)
+            kept.push_back(entry);
+    }
+    return kept;
+}
+
+/* merge sorted (key, data file offset) entries with keys not yet in the index into the tree, adding
+ * levels above the root while it divides
+ */
+void merge_batch(const vector<pair<string, long> > &entries)
+{
+    if (entries.empty())
+        return;
+    for (const pair<string, long> &entry : entries)
+        bloom.add(entry.first);
+
+    Node root(root_address);
+    vector<Split> splits;
+    long top_entries = merge_into_subtree(&root, entries, 0, entries.size(), splits);
+
+    // the root was divided: grow new levels above the pieces until one node holds them all
+    long top = root.address; // a copy-on-write index moved the root even if it wasn't divided
+    while (!splits.empty())
+    {
+        vector<string> keys;
+        vector<long> children(1, top);
+        vector<long> counts(1, top_entries);
+        vector<long> v1;
+        for (const Split &split : splits)
+        {
+            keys.push_back(split.key);
+            children.push_back(split.address);
+            counts.push_back(split.entries);
+        }
+        splits.clear();
+
+        Node* new_root = new Node(false, keys, v1, children);
+        if (new_root->has_counts())
+            new_root->counts = counts;
+        if (!node_fits(new_root))
+        {
+            vector<string> separators;
+            vector<Node*> pieces = split_node_evenly(new_root, separators);
+            for (size_t j = 0 ; j < pieces.size() ; j++)
             {
-                long pointer;
-                memcpy(&pointer, buf + offset, sizeof(pointer));
-                offset += sizeof(pointer);
-                pointers.push_back(pointer);
+                long piece_entries = pieces[j]->entries();
+                pieces[j]->write_to_disk();
+                splits.push_back({ separators[j], pieces[j]->address, piece_entries });
+                delete pieces[j];
             }
         }
+        top_entries = new_root->entries();
+        new_root->write_to_disk();
+        top = new_root->address;
+        delete new_root;
     }
-
-    /* bring the ith child of an internal node into memory 
-     * 
-     * input parameters:
-     * idx (int) - position of the child to bring into memory
-     * 
-     * output (Node *) - reference to the ith child now brought into memory
-     */
-    Node* get_child(int idx)
+    if (top != root_address)
     {
-        long address = children[idx];
-        Node *n = new Node(address);
-        return n;
+        root_address = top;
+        update_metadata();
     }
-};
-
-/* signature for update_metadata function */
-void update_metadata();
+    inner_levels.publish();
+}
 
-/* create a new node with 2*degree+1 keys and 2*degree+2 pointers and remove 'degree' keys from leaf
+/* appends many records (one per line, "-" for standard input) to the data file with one write and
+ * merges their keys into the tree in a single pass
+ * the new keys are sorted and merged leaf by leaf, so every affected node is rewritten once and
+ * overfull nodes are divided in bulk. keys already in the index or repeated in the batch are skipped.
  *
  * input parameters:
- * index (Node *) - the internal node to be split
- * parent_key (Node *) - store the middle key (middle of the split) in this variable
+ * index_file (string) - the index file to insert into
+ * records_file (string) - file holding the records, each starting with its key
  *
- * output (Node *) - the node that was created that contains half the keys (degree) of the internal node
+ * output: void (inserts the records)
  */
-Node* split_index_node(Node* index, string &parent_key) 
+void insert_batch(string index_file, string records_file)
 {
-    // splitting internal node - has (2*degree + 1) keys and (2*degree + 2) pointers
-    parent_key = index->keys[degree];
-    index->keys.erase(index->keys.begin() + degree);
-    
-    // keep first degree keys and degree+1 pointers
-    // move degree keys and degree+1 pointers to new node
-    vector<string> new_keys;
-    vector<long> new_children;
+    index_filename = index_file;
+    initialize_bplus_tree();
 
-    new_children.push_back(index->children[degree + 1]);
-    index->children.erase(index->children.begin() + degree + 1);
-    
-    while (index->keys.size() > degree) 
+    ifstream infile;
+    if (records_file.compare("-") != 0)
     {
-        new_keys.push_back(index->keys[degree]);
-        index->keys.erase(index->keys.begin() + degree);
-        new_children.push_back(index->children[degree + 1]);
-        index->children.erase(index->children.begin() + degree + 1);
+        infile.open(records_file);
+        if (!infile)
+        {
+            cout << "Cannot open records file " << records_file << "\n";
+            return;
+        }
     }
+    istream &in = records_file.compare("-") == 0 ? cin : infile;
 
-    vector<long> v1;
-    Node* new_node = new Node(false, new_keys, v1, new_children);
+    vector<string> records;
+    vector<pair<string, long> > batch; // (key, position in 'records')
+    long too_short = 0;
+    long not_integer = 0; // integer key mode: keys that don't start with the digits
+    string line;
+    while (getline(in, line))
+    {
+        if ((int) line.length() < key_len)
+        {
+            too_short++;
+            continue;
+        }
+        string key = line.substr(0, key_len);
+        if (int_key_width > 0 && !int_key(key, key))
+        {
+            not_integer++;
+            continue;
+        }
+        batch.push_back(make_pair(key, (long) records.size()));
+        records.push_back(line);
+    }
 
-    return new_node;
+    long repeated;
+    shadow.begin();
+    vector<pair<string, long> > kept = unindexed_keys(batch, repeated);
+
+    // append the new records in input order with a single write
+    vector<long> offsets(records.size(), -1);
+    for (const pair<string, long> &entry : kept)
+        offsets[entry.second] = 0;
+    string appended;
+    long data_end = data_device.end_offset;
+    for (size_t r = 0 ; r < records.size() ; r++)
+    {
+        if (offsets[r] == -1)
+            continue;
+        appended += "\n";
+        offsets[r] = data_end + appended.length(); // the record starts after its newline
+        appended += records[r];
+    }
+    if (!appended.empty())
+        uncommitted_start = data_end;
+    data_device.append(appended.c_str(), appended.length());
+
+    vector<pair<string, long> > entries;
+    for (const pair<string, long> &entry : kept)
+        entries.push_back(make_pair(entry.first, offsets[entry.second]));
+    merge_batch(entries);
+    commit_inserts();
+
+    cout << "Inserted " << entries.size() << " records, skipped " << batch.size() - repeated - entries.size()
+         << " keys already in the index and " << repeated << " repeated in the batch\n";
+    if (too_short > 0)
+        cout << too_short << " lines were shorter than the key length\n";
+    if (not_integer > 0)
+        cout << not_integer << " lines didn't start with the " << int_key_digits << " digits of this index's keys\n";
 }
 
-/* create a new node with 'degree' keys and remove 'degree' keys from leaf
+/* index the lines appended to the data file since the index was created or last synced
  *
- * input parameters:
- * leaf (Node *) - the leaf to be split
+ * The metadata records how far the data file was indexed and a fingerprint of it up to there (its
+ * length and sampled blocks, see data_fingerprint()); if the fingerprint still matches, the file is
+ * taken to have been only appended to, and the complete lines after that offset
+ * are merged into the tree like -insertbatch does (the first line of every new key; keys the index
+ * already has are skipped). A last line without its newline may still be being written, so it is
+ * left for the next sync.
  *
- * output (Node *) - the node that was created that contains half the keys (degree) of the leaf
+ * input parameters:
+ * index_file (string) - the index to bring up to date with its data file
  */
-Node* split_leaf_node(Node* leaf) 
+void sync_index(string index_file)
 {
-    vector<string> new_keys;
-    vector<long> new_pointers;
-    
-    // move 'degree' entries to the new node
-    for(int i = degree ; i <= 2*degree ; i++) 
+    index_filename = index_file;
+    initialize_bplus_tree();
+    shadow.begin();
+
+    long size = data_device.end_offset;
+    if (synced_end > size || ((synced_end > 0 || synced_fingerprint != 0) && data_fingerprint(synced_end) != synced_fingerprint))
     {
-        new_keys.push_back(leaf->keys[i]);
-        new_pointers.push_back(leaf->pointers[i]);
+        cout << "Data file " << data_filename << " was changed, not only appended to, since it was indexed; "
+             << "rebuild the index with -create\n";
+        return;
     }
-    
-    // keep first 'degree' entries in the original leaf node
-    for(int i = degree ; i <= 2*degree ; i++) 
+
+    long end = synced_end;
+    vector<pair<string, long> > lines;
+    if (size > synced_end)
     {
-        leaf->keys.pop_back();
-        leaf->pointers.pop_back();
+        const char *data = (const char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, data_device.fd, 0);
+        if (data == MAP_FAILED)
+        {
+            cout << "Cannot map data file " << data_filename << ": " << strerror(errno) << "\n";
+            return;
+        }
+        const char *newline = (const char*) memrchr(data + synced_end, '\n', size - synced_end);
+        if (newline != NULL)
+        {
+            end = newline - data + 1;
+            scan_chunk(data, end, synced_end, end, lines); // (key, offset) of every complete line, sorted
+        }
+        munmap((void*) data, size);
     }
-    
-    vector<long> v1;
-    Node* new_node = new Node(true, new_keys, new_pointers, v1);
-    
-    return new_node;
+
+    vector<pair<string, long> > batch; // (key, position in 'lines')
+    for (size_t i = 0 ; i < lines.size() ; i++)
+        batch.push_back(make_pair(lines[i].first, (long) i));
+    long repeated;
+    vector<pair<string, long> > kept = unindexed_keys(batch, repeated);
+
+    vector<pair<string, long> > entries;
+    for (const pair<string, long> &entry : kept)
+        entries.push_back(make_pair(entry.first, lines[entry.second].second));
+    merge_batch(entries);
+    if (!shadow.active)
+        buffer_pool.flush(); // the tree is complete on disk before the metadata covers the new lines
+
+    long from = synced_end;
+    synced_end = end;
+    synced_fingerprint = data_fingerprint(end);
+    if (shadow.active)
+        shadow.commit(true); // the new synced end is written with the commit record
+    else
+        update_metadata();
+
+    cout << "Indexed " << entries.size() << " new records from data file bytes " << from << " to " << end
+         << ", skipped " << batch.size() - repeated - entries.size() << " keys already in the index and "
+         << repeated << " repeated\n";
 }
 
-/* inserts a key-offset pair in the bplus tree
+/* list a variable number of records starting from a specified key in the open index
  *
  * input parameters:
- * root (Node *) - the current node being inserted in or probed
- * key (string) - the key to be inserted
- * offset (long integer) - the offset in the data file where the key can be found
- *
- * output (Node *) - a pointer to a new node if root was split or NULL in the general case
+ * target_key (string) - the target key (or next largest) to start the listing from
+ * count (int) - the number of records to show following the target_key
+ * out (ostream) - where the records are printed
  */
-Node* insert_record_in_btree(Node* root, string key, long offset)
+void list_from_key(string target_key, int count, ostream &out)
 {
-    root->read_from_disk(); // bring root into the memory buffer
-    if(!root->is_leaf) // root is internal node
+    bool exact;
+    target_key = search_form(target_key, exact); // starting from the next larger key is the same either way
+
+    if (use_mmap && !shadow.active) // the mapped scan follows the leaf chain
     {
-        // find the position of the first key which is greater than key to insert
-        Node* index = root;
-        int posn_key = 0;
-        while (posn_key < index->keys.size()) 
+        MappedIndex mapped;
+        if (!mapped.open())
         {
-            if (key.compare(index->keys[posn_key]) < 0) 
-                break;
-            posn_key++;
+            out << "Cannot map index file " << index_filename << "\n";
+            return;
         }
+        list_records_mapped(mapped, target_key, count, out);
+        return;
+    }
 
-        // insert this entry recursively in the ith child pointer of this internal node
-        Node* newchild = insert_record_in_btree(index->get_child(posn_key), key, offset);
-        
-        if(newchild == NULL) // no splitting occurred in this node's child
-        {
-            return NULL;
-        } 
-        else // splitting occurred, now add a new pointer to this internal node
-        {
-            // find the first corresponding pointer whose key is greater than newchild_key
-            int key_idx = 0;
-            string newchild_key = newchild->keys[0];
-            while (key_idx < index->keys.size()) 
-            {
-                if(newchild_key.compare(index->keys[key_idx]) < 0) 
-                    break;
-                key_idx++;
-            }
-
-            // check if we have to 
-            if (key_idx >= index->keys.size()) 
-            {
-                index->keys.push_back(newchild_key);
-                index->children.push_back(newchild->address);
-            }
-            else 
-            {
-                index->keys.insert(index->keys.begin() + key_idx, newchild_key);
-                index->children.insert(index->children.begin() + key_idx + 1, newchild->address);
-            }
+    list_records_count(target_key, count, out);
+}
 
-            // insert the new pointer in this node as it has space remaining
-            if (index->keys.size() <= 2 * degree)
-            {
-                index->write_to_disk(); // write out to file and delete from buffer
-                return NULL;
-            }
-            else // split this node because it's full
-            {
-                // original node is index and new node is new_child
-                string parent_key = "";
-                newchild = split_index_node(index, parent_key);
+/* list a variable number of records starting from a specified key into the specified index file
+ *
+ * input parameters:
+ * index_file (string) - the index file we will search through
+ * target_key (string) - the target key (or next largest) to start the listing from
+ * count (int) - the number of records to show following the target_key
+ *
+ * output: void (prints the records)
+ */
+void list_records(string index_file, string target_key, int count)
+{
+    index_filename = index_file;
+    initialize_bplus_tree();
 
-                // root was just split
-                if (index->address == root_address) 
-                {
-                    // create a new node new_root containing index and newchild nodes as pointers
-                    // and make the root bptree's pointer point to new_root
-                    index->write_to_disk();
-                    newchild->write_to_disk();
+    list_from_key(target_key, count, cout);
+}
 
-                    // add the index and newchild as children of the new_root
-                    vector<long> new_children;
-                    new_children.push_back(index->address);
-                    new_children.push_back(newchild->address);
+/* number of entries whose key is smaller than 'key' (or not larger, with 'after'), from the entry
+ * counts of the format 3 internal nodes: one root-to-leaf descent adding up the counts of the
+ * children left of the path, then the position of the key in the leaf
+ */
+long rank_of(const string &key, bool after)
+{
+    root_latch.lock_shared();
+    long address = root_address;
+    NodeView n(buffer_pool.latch(address, false));
+    root_latch.unlock_shared();
 
-                    vector<long> v1; // empty variable that will be ignored in the constructor
-                    vector<string> newkeys;
-                    newkeys.push_back(parent_key);
+    long rank = 0;
+    while (!n.is_leaf())
+    {
+        int c = n.upper_bound(key.c_str(), key.length());
+        for (int i = 0 ; i < c ; i++)
+            rank += n.entries(i);
+        long child = n.value(c);
+        n = NodeView(buffer_pool.latch(child, false));
+        buffer_pool.unlatch(address, false, false);
+        address = child;
+    }
+    rank += after ? n.upper_bound(key.c_str(), key.length()) : n.lower_bound(key.c_str(), key.length());
+    buffer_pool.unlatch(address, false, false);
+    return rank;
+}
 
-                    // create the new_root
-                    Node* new_root = new Node(false, newkeys, v1, new_children);
-                    new_root->write_to_disk();
+/* find the entry at position 'position' (from 0) in key order by following the entry counts down
+ *
+ * input parameters:
+ * position (long int) - the position of the entry
+ * payload (string *) - if given and the index is covering, set to the covered bytes of the record
+ *
+ * output (long int) - the data file offset of the entry, or -1 past the last entry
+ */
+long select_entry(long position, string *payload = NULL)
+{
+    if (position < 0)
+        return -1;
 
-                    // update the root_address and update the first metadata block using update_metadata()
-                    root_address = new_root->address;
-                    update_metadata();
+    root_latch.lock_shared();
+    long address = root_address;
+    NodeView n(buffer_pool.latch(address, false));
+    root_latch.unlock_shared();
 
-                    return NULL;
-                }
-                return newchild;
-            }
-        }
+    while (!n.is_leaf())
+    {
+        int c = 0;
+        while (c < n.count() && position >= n.entries(c))
+            position -= n.entries(c++);
+        long child = n.value(c);
+        n = NodeView(buffer_pool.latch(child, false));
+        buffer_pool.unlatch(address, false, false);
+        address = child;
     }
-    else // root is leaf node
+
+    long offset = -1;
+    if (position < n.count())
     {
-        Node* leaf = root;
-        
-        // find the position of the first key which is greater than key to insert
-        if (key.compare(leaf->keys[0]) < 0) // insert at the beginning
-        {
-            leaf->keys.insert(leaf->keys.begin(), key);
-            leaf->pointers.insert(leaf->pointers.begin(), offset);
-        } 
-        else if (key.compare(leaf->keys[leaf->keys.size() - 1]) > 0) // insert at the end
-        {
-            leaf->keys.push_back(key);
-            leaf->pointers.push_back(offset);
-        } 
-        else // insert somewhere in between
+        offset = n.value(position);
+        if (payload != NULL && cover_len != 0)
         {
-            for(int key_idx = 0 ; key_idx < leaf->keys.size() ; key_idx++)
-            {
-                if (leaf->keys[key_idx].compare(key) > 0) {
-                    leaf->keys.insert(leaf->keys.begin() + key_idx, key);
-                    leaf->pointers.insert(leaf->pointers.begin() + key_idx, offset);
-                    break;
-                }
-            }
+            long len;
+            const char *encoded = n.payload(position, len);
+            *payload = decode_payload(encoded, len);
         }
+    }
+    buffer_pool.unlatch(address, false, false);
+    return offset;
+}
 
-        // since this leaf has space, insert this entry recursively in the ith position
-        if(leaf->keys.size() <= 2 * degree) 
+/* whether 'arg' is a record position for -select: a number from 0, in decimal digits only */
+bool is_position(const string &arg)
+{
+    if (arg.empty() || arg.length() > 18) // longer ones could overflow a long
+        return false;
+    for (char c : arg)
+        if (c < '0' || c > '9')
+            return false;
+    return true;
+}
+
+/* answer an order statistics request on the open index (entry counts are only kept by format 3)
+ *
+ * input parameters:
+ * command (string) - "count" (entries with keys from arg to arg2), "rank" (entries with keys smaller
+ *                    than arg) or "select" (the record at position arg, from 0, in key order)
+ * arg, arg2 (string) - the keys or position
+ * out (ostream) - where the answer is printed
+ */
+void order_statistic(string command, string arg, string arg2, ostream &out)
+{
+    if (format_version != 3)
+    {
+        out << "Order statistics need an index created with -format 3\n";
+        return;
+    }
+
+    bool exact, exact2;
+    string key = search_form(pad_key(arg), exact);
+    string key2 = search_form(pad_key(arg2), exact2);
+    Snapshot snapshot;
+    if (command == "count") // a bound no key can equal counts the keys below the next key that fits
+        out << max(0L, rank_of(key2, exact2) - rank_of(key, false)) << "\n";
+    else if (command == "rank")
+        out << rank_of(key, false) << "\n";
+    else
+    {
+        if (!is_position(arg))
         {
-            leaf->write_to_disk();
-            return NULL;
+            out << "Position must be a record number from 0\n";
+            return;
         }
-        else // splitting occurred, now add a new pointer to this leaf node
+        string payload;
+        long offset = select_entry(atol(arg.c_str()), &payload);
+        if (offset == -1)
         {
-            Node* newchild = split_leaf_node(leaf);
+            out << "Position is past the last record.\n";
+            return;
+        }
+        out << "[" << offset << "]: ";
+        if (cover_len != 0)
+            out << payload << "\n";
+        else
+            print_record_at_offset(offset, out);
+    }
+}
 
-            if (leaf->address == root_address) // if this leaf was the root, make a new root
-            {
-                vector<string> newkeys;
-                newkeys.push_back(newchild->keys[0]);
+/* order statistics over the specified index file (-count, -rank and -select) */
+void order_statistic_index(string index_file, string command, string arg, string arg2)
+{
+    index_filename = index_file;
+    initialize_bplus_tree();
 
-                // set prev/next siblings - point prev's next and next's prev to newchild
-                long tmp = leaf->next;
-                newchild->prev = leaf->address;
-                newchild->next = tmp;
-                if (tmp != -1) 
-                {
-                    Node *n = new Node(tmp);
-                    n->prev = newchild->address; // check against NULL next pointer
-                    n->write_to_disk();
-                }
+    order_statistic(command, arg, arg2, cout);
+}
+
+/* updates the root address whenever it may have changed (during splitting) */
+void update_metadata()
+{
+    if (wal.active || shadow.open) // the root address is recorded by the next log or shadow commit instead
+        return;
+    create_index(data_filename, index_filename, key_len, root_address, true);
+}
+
+/* checkpoint the redo log of an index file (-checkpoint)
+ *
+ * input parameters:
+ * index_file (string) - the index whose log is written into it
+ */
+void checkpoint_index(string index_file)
+{
+    if (access(WriteAheadLog::log_name(index_file).c_str(), F_OK) != 0)
+    {
+        cout << "Index file " << index_file << " has no redo log\n";
+        return;
+    }
+    index_filename = index_file;
+    initialize_bplus_tree();
+    if (!wal.replayed.empty())
+        cout << "Redo log " << wal.device.filename << " is being written by another process, which checkpoints it\n";
+    else
+        cout << "Checkpointed redo log " << wal.device.filename << "\n";
+}
 
-                newchild->write_to_disk();
-                leaf->next = newchild->address;
-                leaf->write_to_disk();
+/* writes every logged block and the root address into the index file, then empties the redo log */
+void checkpoint()
+{
+    // blocks replayed when the index was opened go first, so the pool's newer copies overwrite them
+    for (const pair<const long, string> &block : wal.replayed)
+        index_device.write_at(block.first, block.second.data(), block_size);
+    wal.replayed.clear();
+    buffer_pool.flush();
+    create_index(data_filename, index_filename, key_len, root_address, true);
+    index_device.sync();
+    wal.reset();
+}
 
-                // add leaf and newchild pointers to our new_root
-                vector<long> new_children;
-                new_children.push_back(leaf->address);
-                new_children.push_back(newchild->address);
-                vector<long> v1;
+// largest request or response frame accepted over the server socket
+const uint32_t max_frame_size = 16 * 1024 * 1024;
 
-                // create the new_root
-                Node* new_root = new Node(false, newkeys, v1, new_children);
-                new_root->is_leaf = false;
-                new_root->write_to_disk();
+// set by SIGINT / SIGTERM to make serve_index() shut down cleanly
+volatile sig_atomic_t stop_serving = 0;
 
-                // update the root_address and update the first metadata block using update_metadata()
-                root_address = new_root->address;
-                update_metadata();
+void handle_stop_signal(int)
+{
+    stop_serving = 1;
+}
 
-                return NULL;
-            }
-            else
-            {
-                newchild->write_to_disk();
-                newchild->read_from_disk(); // write and read to get a valid address for newchild
+/* frames 'payload' for the socket protocol: a 4 byte length in host byte order followed by the bytes */
+string make_frame(const string &payload)
+{
+    uint32_t len = payload.length();
+    string frame((const char*) &len, sizeof(len));
+    return frame + payload;
+}
 
-                // set prev/next siblings - point prev's next and next's prev to newchild
-                long tmp = leaf->next;
-                leaf->next = newchild->address;
-                newchild->prev = leaf->address;
-                newchild->next = tmp;
-                if (tmp != -1) 
-                {
-                    Node *n = new Node(tmp);
-                    n->prev = newchild->address; // check against NULL next pointer
-                    n->write_to_disk();
-                }
+/* removes one complete frame from the front of 'buffer'
+ *
+ * output (int) - 1 if a frame was moved into 'payload', 0 if more bytes are needed, -1 if the frame is too large
+ */
+int take_frame(string &buffer, string &payload)
+{
+    if (buffer.length() < sizeof(uint32_t))
+        return 0;
+    uint32_t len;
+    memcpy(&len, buffer.data(), sizeof(len));
+    if (len > max_frame_size)
+        return -1;
+    if (buffer.length() < sizeof(len) + len)
+        return 0;
+    payload = buffer.substr(sizeof(len), len);
+    buffer.erase(0, sizeof(len) + len);
+    return 1;
+}
 
-                newchild->write_to_disk();
-                leaf->write_to_disk();
-            }
-            return newchild;
-        }
+/* answers one request against the open index, using the same output as the matching command line option
+ *
+ * input parameters:
+ * request (string) - "find <key>", "list <key> <count>", "insert <record>" or "stats"
+ *
+ * output (string) - the text the command would have printed
+ */
+string handle_request(const string &request)
+{
+    ostringstream out;
+    size_t space = request.find(' ');
+    string command = request.substr(0, space);
+    string arg = space == string::npos ? "" : request.substr(space + 1);
+
+    if (command == "find" && !arg.empty())
+        find_key(arg, out);
+    else if (command == "list" && arg.rfind(' ') != string::npos)
+    {
+        size_t last = arg.rfind(' ');
+        int count = atoi(arg.c_str() + last + 1);
+        list_from_key(arg.substr(0, last), count, out);
     }
+    else if (command == "insert" && !arg.empty())
+        insert_line(arg, out);
+    else if (command == "count" && arg.rfind(' ') != string::npos)
+    {
+        size_t last = arg.rfind(' ');
+        order_statistic(command, arg.substr(0, last), arg.substr(last + 1), out);
+    }
+    else if ((command == "rank" || command == "select") && !arg.empty())
+        order_statistic(command, arg, "", out);
+    else if (command == "stats")
+    {
+        buffer_pool.print_stats(out);
+        if (bloom.lines > 0)
+            bloom.print_stats(out);
+    }
+    else
+        out << "Unknown request: " << request << "\n";
+    return out.str();
 }
 
-/* find a record in the current index_filename
+/* binds a listening Unix domain socket at 'socket_path', replacing a stale socket file
+ *
+ * output (int) - the listening descriptor or -1 after printing an error
+ */
+int listen_unix_socket(const string &socket_path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.length() >= sizeof(addr.sun_path))
+    {
+        cout << "Socket path too long: " << socket_path << "\n";
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        cout << "Cannot create socket: " << strerror(errno) << "\n";
+        return -1;
+    }
+    unlink(socket_path.c_str());
+    if (bind(fd, (sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, 128) != 0)
+    {
+        cout << "Cannot listen on " << socket_path << ": " << strerror(errno) << "\n";
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+/* keeps the index open and answers length-prefixed requests from any number of clients on a Unix socket
+ * requests are handled one at a time, so the buffer pool stays warm between them and no locking is needed
  *
  * input parameters:
- * root (Node *) - pointer to current node being searched
- * key (string) - key to search for
+ * index_file (string) - the index file to serve
+ * socket_path (string) - where the listening socket is created
  *
- * output (long int) - the offset of the key or -1
+ * output: void (runs until SIGINT or SIGTERM, then flushes the buffer pool and removes the socket)
  */
-long find_record(Node* root, string key)
+void serve_index(string index_file, string socket_path)
 {
-    if (root == NULL)
-        return NULL;
+    index_filename = index_file;
+    initialize_bplus_tree();
+    defer_commit = wal.active || shadow.active;
+
+    int listener = listen_unix_socket(socket_path);
+    if (listener < 0)
+        return;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct Client
+    {
+        int fd;
+        string in;  // bytes received but not yet forming a whole request
+        string out; // framed responses not yet written
+    };
+    vector<Client> clients;
+    char buf[65536];
+
+    cout << "Serving " << index_file << " on " << socket_path << endl;
+    while (!stop_serving)
+    {
+        vector<pollfd> fds(1 + clients.size());
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for (size_t c = 0; c < clients.size(); c++)
+        {
+            fds[c + 1].fd = clients[c].fd;
+            fds[c + 1].events = clients[c].out.empty() ? POLLIN : POLLIN | POLLOUT;
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            cout << "poll failed: " << strerror(errno) << "\n";
+            break;
+        }
 
-    root->read_from_disk();
-    if (root->is_leaf) // reached a leaf node
-    {
-        // iterate through all values of this node
-        for(int key_idx = 0 ; key_idx < root->keys.size() ; key_idx++)
+        shadow.refresh(); // this round sees what other processes committed to a copy-on-write index
+
+        // serve the connected clients first, since the accepts below grow 'clients'
+        for (size_t c = 0; c < clients.size(); c++)
         {
-            if (key.compare(root->keys[key_idx]) == 0) // if any key matches exactly, return it
+            Client &client = clients[c];
+            short revents = fds[c + 1].revents;
+
+            if (revents & (POLLIN | POLLHUP | POLLERR))
             {
-                long p = root->pointers[key_idx];
-                root->flush_node();
-                return p;
+                ssize_t n = read(client.fd, buf, sizeof(buf));
+                if (n > 0)
+                    client.in.append(buf, n);
+                else if (n == 0 || (errno != EINTR && errno != EAGAIN))
+                {
+                    close(client.fd);
+                    client.fd = -1;
+                    continue;
+                }
             }
-        }
-        return -1; // return -1 if no key matches
-    }
-    else // route the search query in internal nodes after comparing key
-    {
-        // if search key is smaller than ith key of internal node
-        for(int key_idx = 0 ; key_idx < root->keys.size() ; key_idx++)
-        {
-            // go down the child pointer whose corresponding key is less than the target
-            if (key.compare(root->keys[key_idx]) < 0)
+
+            string request;
+            int status;
+            while ((status = take_frame(client.in, request)) == 1)
+                client.out += make_frame(handle_request(request));
+            if (status < 0)
             {
-                Node* c = root->get_child(key_idx);
-                root->flush_node();
-                return find_record(c, key);
+                close(client.fd);
+                client.fd = -1;
             }
         }
-        Node* c = root->get_child(root->children.size() - 1);
-        root->flush_node();
-        return find_record(c, key);  // follow rightmost pointer
-    }
-}
 
-/* helper function for printing a record at a specified offset in the data_filename */
-void print_record_at_offset(long key_offset)
-{
-    // open file at offset address, read till end of line
-    char buf[1001] = "";
-    ifstream infile(data_filename);
-    infile.seekg(key_offset, infile.beg);
-    infile.read(buf, 1000);
-    infile.close();
-    string str(buf);
-    cout << str.substr(0, str.find("\n")) << endl;
-}
+        // one commit covers every insert received in this round, before any of them is acknowledged
+        if (uncommitted_inserts > 0 || shadow.open)
+            commit_inserts();
 
-/* helper function for list_records() */
-void list_records_count(Node* root, string target_key, int count)
-{
-    root->read_from_disk(); // bring the current node into the buffer
-    if (root->is_leaf) // if its a leaf
-    {
-        for(int i = 0 ; i < root->keys.size() ; i++)
+        for (Client &client : clients)
         {
-            // if any key matches or our target is between any 2 consecutive keys or there's only 1 key
-            if (target_key.compare(root->keys[i]) == 0 || 
-                (i > 0 && target_key.compare(root->keys[i-1]) < 0 && target_key.compare(root->keys[i]) > 0) || 
-                (root->keys.size() == 1))
+            bool closed = client.fd < 0;
+            if (!closed && !client.out.empty())
             {
-                // start printing from here till 'count' next nodes
-                while (root && count > 0)
-                {
-                    for(int a = i ; a < root->keys.size() && count > 0 ; a++)
-                    {
-                        cout << "[" << root->pointers[a] << "]: ";
-                        count--;
-                        print_record_at_offset(root->pointers[a]);
-                    }
-                    cout << endl;
+                ssize_t n = write(client.fd, client.out.data(), client.out.length());
+                if (n > 0)
+                    client.out.erase(0, n);
+                else if (n < 0 && errno != EINTR && errno != EAGAIN)
+                    closed = true;
+            }
 
-                    if (root->next == -1) break; // follow the next pointer to a sibling leaf node
-                    long next_root = root->next;
-                    root->flush_node();
-                    root = new Node(next_root);
-                }
-                return;
+            if (closed && client.fd >= 0)
+            {
+                close(client.fd);
+                client.fd = -1;
             }
         }
-    }
-    else
-    {
-        // if search key is smaller than ith key of internal node
-        for(int key_idx = 0 ; key_idx < root->keys.size() ; key_idx++)
+        clients.erase(remove_if(clients.begin(), clients.end(), [](const Client &c) { return c.fd < 0; }), clients.end());
+
+        if (fds[0].revents & POLLIN)
         {
-            if (target_key.compare(root->keys[key_idx]) < 0) // go down the child pointer whose corresponding key is smaller
+            int fd;
+            while ((fd = accept(listener, NULL, NULL)) >= 0)
             {
-                Node* c = root->get_child(key_idx);
-                root->flush_node();
-                return list_records_count(c, target_key, count);
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                clients.push_back({fd, "", ""});
             }
         }
-
-        // didn't match any - going for last child pointer
-        Node* c = root->get_child(root->children.size() - 1);
-        root->flush_node();
-        return list_records_count(c, target_key, count); // follow rightmost pointer
     }
-}
-
-/* fills the global variables after reading data from the first metadata block
- *
- * output (void) -reads the metadata block at address 0 only
- */
-void initialize_bplus_tree()
-{
-    // read first 1024kb block to get the data filename, keylength and degree
-    long offset = 0;
-    char buffer[block_size];
-
-    ifstream infile;
-    infile.open(index_filename, ios::in | ios::binary);
-    infile.read(buffer, block_size);
-    infile.close();
-
-    // read data_filename
-    string get_data_filename(buffer, 257);
-    int end_idx = get_data_filename.find("0000"); // assumming no filename has 4 0s
-    data_filename = get_data_filename.substr(0, end_idx);
-    offset += 257;
-
-    // read key_len
-    memcpy(&key_len, buffer + offset, sizeof(key_len));
-    offset += sizeof(key_len);
-
-    // read degree
-    memcpy(&degree, buffer + offset, sizeof(degree));
-    offset += sizeof(degree);
 
-    // read root location
-    memcpy(&root_address, buffer + offset, sizeof(root_address));
-    offset += sizeof(root_address);
+    for (Client &client : clients)
+        close(client.fd);
+    close(listener);
+    unlink(socket_path.c_str());
+    commit_inserts();
+    if (wal.active)
+        checkpoint();
+    cout << "Server stopped\n";
 }
 
-/* create or update an index file and the first metadata block at position 0
+/* sends requests to a running -serve process and prints each response
  *
  * input parameters:
- * data_file (string) - the file containing all the records to insert
- * index_file (string) - the index file that will store bplus tree key + offsets
- * keylen (int) - the key length of the file
- * new_root_address (long int) - the root address to be written - used only if the global root_address is not initialized
- * update_flag (bool) - specifies whether we are creating the index for the first time or just updating it
+ * socket_path (string) - the server's socket
+ * request (string) - a single request, or "-" to send one request per line read from stdin
  *
- * output (void) - creates or updates the index
+ * output: void (prints the responses)
  */
-void create_index(string data_file, string index_file, int keylen, long new_root_address, bool update_flag=false)
+void run_client(string socket_path, string request)
 {
-    /* create index file with one 1024kb block
-     * structure:
-     * data filename (256 bytes)
-     * key length (4 bytes - int)
-     * degree (4 bytes - int)
-     * root_address (8 bytes - long)
-     */
-    long offset = 0;
-    char buffer[block_size];
-
-    // write filename in first 256 bytes
-    string filename = data_file.append(string((256 - data_file.length()), '0'));
-    memcpy(buffer + offset, filename.c_str(), strlen(filename.c_str()) + 1);
-    offset += strlen(filename.c_str()) + 1;
-
-    // write keylen
-    memcpy(buffer + offset, &keylen, sizeof(keylen));
-    offset += sizeof(keylen);
-
-    // calculate degree of a node (a node can store degree <= n <= 2*degree key-value pairs)
-    // assume 50 bytes for metadata (on the safe side)
-    // the exact number of bytes used in a block apart from records = 25 bytes (3 longs and a bool)
-    int degree = (block_size - 50)/ ((keylen+8)*2); // each record is key_length bytes + 8 bytes for a long
-
-    // write degree
-    memcpy(buffer + offset, &degree, sizeof(degree));
-    offset += sizeof(degree);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
 
-    // write root address with default as 1024 otherwise use the global variable value
-    if (new_root_address == -1) 
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0)
     {
-        new_root_address = 1024;
-        root_address = 1024;
+        cout << "Cannot connect to " << socket_path << ": " << strerror(errno) << "\n";
+        exit(1);
     }
-    memcpy(buffer + offset, &new_root_address, sizeof(new_root_address));
-    offset += sizeof(new_root_address);
-
-    // copy buffer to file
-    ofstream outfile;
-    // we open the output file as ios::in and ios::out when we're updating it
-    // but open only as ios::out when we're creating it for the first time
-    if (update_flag) 
-        outfile.open(index_file, ios::in | ios::out | ios::binary);
-    else
-        outfile.open(index_file, ios::out | ios::binary);
-    outfile.write(buffer, block_size);
-    outfile.close();
-
-    if (update_flag) // if this was just an update then no need to insert everything again
-        return;
-
-    // initialize the root of the bplus tree
-    index_filename = index_file;
-    initialize_bplus_tree();
 
-    // iterate through the data file and keep inserting records into index
-    ifstream infile(data_filename);
-    string line;
-    offset = 0;
-
-    int count = 0;
-    Node* root;
-    bool first_time = true;
-
-    // for each record
-    while (getline(infile, line)) 
+    bool from_stdin = request == "-";
+    string buffer, response;
+    while (!from_stdin || getline(cin, request))
     {
-        // insert pair(string, offset) in records array and update offset
-        string key = line.substr(0, key_len);
-        if (first_time) // for the first insert, create a root otherwise read the root_address
+        if (request.empty())
+            continue;
+        string frame = make_frame(request);
+        for (size_t sent = 0; sent < frame.length(); )
         {
-            root = new Node(true, key, offset, NULL);
-            first_time = false;
+            ssize_t n = write(fd, frame.data() + sent, frame.length() - sent);
+            if (n <= 0)
+            {
+                cout << "Lost connection to server\n";
+                exit(1);
+            }
+            sent += n;
         }
-        else
+
+        int status;
+        char buf[65536];
+        while ((status = take_frame(buffer, response)) == 0)
         {
-            root = new Node(root_address);
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0)
+            {
+                cout << "Lost connection to server\n";
+                exit(1);
+            }
+            buffer.append(buf, n);
+        }
+        if (status < 0)
+        {
+            cout << "Response too large\n";
+            exit(1);
         }
+        cout << response;
 
-        insert_record_in_btree(root, key, offset);
-        offset = infile.tellg();;
-        count++;
+        if (!from_stdin)
+            break;
     }
-    cout << "Successfully inserted " << count << " records in index file b+ tree." << endl;
+    close(fd);
 }
 
-/* find an exact target key in the specified index file and print its offset or a message if not found
+/* measures lookup and scan throughput of the open index with 1, 2, 4, ... up to 'threads' reader
+ * threads sharing the buffer pool, optionally while one writer thread inserts new random records
+ * readers pick random existing keys: 15 of every 16 operations are find_record() calls and the
+ * other is a 10 record scan through list_records_count()
  *
  * input parameters:
- * index_file (string) - the index file we will search through
- * target_key (string) - the key to search for
+ * index_file (string) - the index file to run against
+ * threads (int) - the largest number of reader threads to try
+ * seconds (double) - how long each thread count runs
+ * writer (bool) - whether to insert records (appended to the data file) during every run
  *
- * output (void) -finds the record
+ * output: void (prints one line of throughput per thread count)
  */
-void find_index(string index_file, string target_key)
+void stress_index(string index_file, int threads, double seconds, bool writer)
 {
     index_filename = index_file;
     initialize_bplus_tree();
-    // TODO - check if empty index file then return -1
 
-    Node* root = new Node(root_address);
+    // sample the existing keys from the leaf level
+    vector<string> keys;
+    {
+        RangeCursor cursor;
+        cursor.seek("", 0);
+        do
+            keys.insert(keys.end(), cursor.leaf.keys.begin(), cursor.leaf.keys.end());
+        while (keys.size() < 1000000 && cursor.next_leaf());
+    }
+    if (keys.empty())
+    {
+        cout << "Index is empty\n";
+        return;
+    }
+
+    vector<int> counts;
+    for (int t = 1 ; t < threads ; t *= 2)
+        counts.push_back(t);
+    counts.push_back(threads);
 
-    // if key supplied is longer than key_len, truncate it or pad it with blanks
-    if (target_key.length() > key_len) 
-        target_key = target_key.substr(0, key_len);
-    else if (target_key.length() < key_len)
+    vector<string> inserted;
+    atomic<long> missing(0);
+    cout << "threads   lookups/s     scans/s   inserts/s\n";
+    for (int t : counts)
     {
-        while (target_key.length() < key_len)
-            target_key = target_key + " ";
+        atomic<bool> stop(false);
+        atomic<long> lookups(0), scans(0), inserts(0);
+        vector<thread> workers;
+
+        for (int w = 0 ; w < t ; w++)
+        {
+            workers.push_back(thread([&, w]()
+            {
+                mt19937 rng(w + 1);
+                ostream sink(NULL); // scans format their records but the output is discarded
+                long found = 0, scanned = 0;
+                while (!stop.load(memory_order_relaxed))
+                {
+                    const string &key = keys[rng() % keys.size()];
+                    if (rng() % 16 != 0)
+                    {
+                        if (find_record(key) == -1)
+                            missing++;
+                        found++;
+                    }
+                    else
+                    {
+                        list_records_count(key, 10, sink);
+                        scanned++;
+                    }
+                }
+                lookups += found;
+                scans += scanned;
+            }));
+        }
+        if (writer)
+        {
+            workers.push_back(thread([&]()
+            {
+                mt19937_64 rng(inserted.size() + 1);
+                ostream sink(NULL);
+                while (!stop.load(memory_order_relaxed))
+                {
+                    string key;
+                    while (key.length() < key_len)
+                        key += '0' + rng() % 10;
+                    insert_line(key + " stress record", sink);
+                    if (int_key_width > 0)
+                        int_key(key, key); // looked up below in the stored form, like the sampled keys
+                    inserted.push_back(key);
+                    inserts++;
+                }
+            }));
+        }
+
+        this_thread::sleep_for(chrono::duration<double>(seconds));
+        stop = true;
+        for (thread &worker : workers)
+            worker.join();
+
+        cout << fixed << setprecision(0) << setw(7) << t << setw(12) << lookups / seconds
+             << setw(12) << scans / seconds << setw(12) << inserts / seconds << endl;
     }
 
-    long key_offset = find_record(root, target_key);
-    if (key_offset == -1)
-        cout << "Cannot find specified record in index.\n";
-    else
-        print_record_at_offset(key_offset);
+    // every record inserted during the runs must be reachable once the writers are done
+    for (const string &key : inserted)
+        if (find_record(key) == -1)
+            missing++;
+    if (missing > 0)
+        cout << missing << " keys could not be found\n";
 }
 
-/* inserts a new string into the specified index file
- * first insert this record in the data file before inserting its pointer in the index file
+/* compare the I/O engines on batched lookups and a range scan, starting each run from a cold cache
  *
- * input parameters:
- * index_file (string) - the index file we will search through
- * initial_key (string) - the key to insert
+ * Before every run the buffer pool is emptied and the OS is asked to drop its cached pages of the
+ * index and data files (posix_fadvise DONTNEED), so the runs measure device reads. The "sync" row is
+ * the plain synchronous path with one read in flight.
  *
- * output: void (inserts the record)
+ * input parameters:
+ * index_file (string) - the index to read
+ * keys_file (string) - the keys of the batched lookups, as for -findbatch
+ * scan_count (long int) - number of entries in the scan, which starts from the smallest key
  */
-void insert_record(string index_file, string initial_key)
+void io_benchmark(string index_file, string keys_file, long scan_count)
 {
     index_filename = index_file;
     initialize_bplus_tree();
 
-    if (key_len > initial_key.length())
-    {
-        cout << "Input Error: key supplied is too short\n";
+    vector<pair<string, long> > batch;
+    long lines;
+    if (!read_batch_keys(keys_file, batch, lines))
         return;
-    }
-    string key = initial_key.substr(0, key_len);
-    Node* root = new Node(root_address);
 
-    // if key doesn't exist in index file, first insert record in data file then insert that key+its offset in bptree
-    if (find_record(root, key) != -1)
-    {
-        cout << "Key already exists in the index.\n";
-        return;
-    }
-    else
+    cout << "engine     lookups/s   lookup ms  scan rows/s     scan ms\n";
+    for (string kind : { "sync", "threads", "uring" })
     {
-        // append record at the end of the data file and then insert normally into index
-        ofstream outfile;
-        outfile.open(data_filename, ios::out | ios::binary | ios::app);
-        long key_offset = outfile.tellp();
-        initial_key = "\n" + initial_key;
+        string started = io_engine.open(kind);
+        if (started != kind)
+        {
+            cout << setw(7) << kind << "   unavailable\n";
+            continue;
+        }
 
-        cout << "Inserting \"" << initial_key << "\" at line number: " << key_offset << endl;
+        buffer_pool.open(buffer_pool_budget);
+        posix_fadvise(index_device.fd, 0, 0, POSIX_FADV_DONTNEED);
+        posix_fadvise(data_device.fd, 0, 0, POSIX_FADV_DONTNEED);
+        ostream sink(NULL);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        find_batch_keys(batch, lines, sink);
+        double lookup = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-        outfile.write(initial_key.c_str(), initial_key.length());
-        outfile.close();
-        insert_record_in_btree(root, key, key_offset + 1); // add 1 to account for newline
+        buffer_pool.open(buffer_pool_budget);
+        posix_fadvise(index_device.fd, 0, 0, POSIX_FADV_DONTNEED);
+        posix_fadvise(data_device.fd, 0, 0, POSIX_FADV_DONTNEED);
+        start = chrono::steady_clock::now();
+        list_records_count("", scan_count, sink);
+        double scan = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        cout << fixed << setprecision(0) << setw(7) << kind << setw(14) << lines / lookup
+             << setw(12) << setprecision(1) << lookup * 1000 << setprecision(0) << setw(13) << scan_count / scan
+             << setw(12) << setprecision(1) << scan * 1000 << endl;
     }
 }
 
-/* list a variable number of records starting from a specified key into the specified index file
+/* looks up a trailing "-name value" option on the command line
  *
  * input parameters:
- * index_file (string) - the index file we will search through
- * target_key (string) - the target key (or next largest) to start the listing from
- * count (int) - the number of records to show following the target_key
+ * first (int) - index of the first argv entry that may hold an option
+ * name (string) - the option to look for, e.g. "-fill"
+ * def (string) - value returned when the option isn't given
  *
- * output: void (prints the records)
+ * output (string) - the option's value
  */
-void list_records(string index_file, string target_key, int count)
+string get_option(int argc, char **argv, int first, string name, string def)
 {
-    index_filename = index_file;
-    initialize_bplus_tree();
-    Node* root = new Node(root_address);
-
-    list_records_count(root, target_key, count);
+    for (int i = first ; i + 1 < argc ; i++)
+    {
+        if (name.compare(argv[i]) == 0)
+            return string(argv[i + 1]);
+    }
+    return def;
 }
 
-/* updates the root address whenever it may have changed (during splitting) */
-void update_metadata()
+/* checks whether a trailing flag such as "-stats" was given on the command line */
+bool has_flag(int argc, char **argv, int first, string name)
 {
-    create_index(data_filename, index_filename, key_len, root_address, true);
+    for (int i = first ; i < argc ; i++)
+    {
+        if (name.compare(argv[i]) == 0)
+            return true;
+    }
+    return false;
 }
 
 int main(int argc, char **argv)
 {
-    if (argc < 4 || argc > 6)
+    if (argc < 3 || (argc < 4 && string(argv[1]).compare("-sync") != 0 && string(argv[1]).compare("-checkpoint") != 0))
     {
         cout << "Incorrect number of arguments\n";
         return 0;
@@ -863,7 +7344,35 @@ int main(int argc, char **argv)
 
     string choice(argv[1]);
 
-    if (choice.compare("-create") == 0) // ./a.out -create data.txt data1.indx 15
+    // options shared by all commands
+    buffer_pool_budget = stol(get_option(argc, argv, 2, "-cache", "4096")) * 1024;
+    use_direct_io = has_flag(argc, argv, 2, "-direct");
+    use_mmap = has_flag(argc, argv, 2, "-mmap");
+    pin_inner_levels = !has_flag(argc, argv, 2, "-nopin");
+    string search_kind = get_option(argc, argv, 2, "-search", "fixed");
+    if (search_kind != "fixed" && search_kind != "simd")
+    {
+        cout << "In-node search must be fixed or simd\n";
+        return 0;
+    }
+    use_simd_search = search_kind == "simd";
+    bool print_stats = has_flag(argc, argv, 2, "-stats");
+    wal.active = has_flag(argc, argv, 2, "-wal") && choice.compare("-create") != 0 && choice.compare("-insertbatch") != 0
+                 && choice.compare("-sync") != 0 && choice.compare("-checkpoint") != 0;
+    wal.fold = !wal.active && (choice.compare("-insert") == 0 || choice.compare("-insertbatch") == 0
+               || choice.compare("-sync") == 0 || choice.compare("-serve") == 0 || choice.compare("-stress") == 0
+               || choice.compare("-checkpoint") == 0);
+    wal.checkpoint_bytes = stol(get_option(argc, argv, 2, "-walsize", "64")) * 1024 * 1024;
+    string io_kind = get_option(argc, argv, 2, "-io", "uring");
+    io_engine.depth = stoi(get_option(argc, argv, 2, "-iodepth", "64"));
+    if ((io_kind != "uring" && io_kind != "threads" && io_kind != "sync") || io_engine.depth < 1)
+    {
+        cout << "I/O engine must be uring, threads or sync with a positive -iodepth\n";
+        return 0;
+    }
+    io_engine.requested = io_kind; // started by the first batch or scan that reads through it
+
+    if (choice.compare("-create") == 0) // ./a.out -create data.txt data1.indx 15 [-fill 0.9] [-format 3] [-pagesize 4096] [-threads 8] [-sortmem 512] [-cover all] [-intkeys] [-cow]
     {
         string data_filename(argv[2]);
         if (data_filename.length() > 256)
@@ -873,6 +7382,60 @@ int main(int argc, char **argv)
         }
         string index_file(argv[3]);
         int keylen = stoi(argv[4]);
+        fill_factor = stod(get_option(argc, argv, 5, "-fill", "1.0"));
+        if (fill_factor <= 0 || fill_factor > 1)
+        {
+            cout << "Fill factor must be greater than 0 and at most 1\n";
+            return 0;
+        }
+        block_size = stoi(get_option(argc, argv, 5, "-pagesize", "1024"));
+        if (block_size < 1024 || block_size > 32768 || (block_size & (block_size - 1)) != 0)
+        {
+            cout << "Page size must be a power of two from 1024 to 32768 bytes\n";
+            return 0;
+        }
+        build_threads = stoi(get_option(argc, argv, 5, "-threads", to_string(max(1u, thread::hardware_concurrency()))));
+        sort_budget = stol(get_option(argc, argv, 5, "-sortmem", "512")) * 1024 * 1024;
+        if (sort_budget <= 0)
+        {
+            cout << "Sort memory must be at least 1 MB\n";
+            return 0;
+        }
+        format_version = stoi(get_option(argc, argv, 5, "-format", "3"));
+        if (format_version < 1 || format_version > 3)
+        {
+            cout << "Node format must be 1, 2 or 3\n";
+            return 0;
+        }
+        string cover = get_option(argc, argv, 5, "-cover", "");
+        if (cover.compare("all") == 0)
+        {
+            cover_start = 0;
+            cover_len = -1;
+        }
+        else if (!cover.empty())
+        {
+            size_t colon = cover.find(':');
+            cover_start = colon == string::npos ? -1 : atoi(cover.substr(0, colon).c_str());
+            cover_len = colon == string::npos ? 0 : atoi(cover.substr(colon + 1).c_str());
+            if (cover_start < 0 || cover_len <= 0)
+            {
+                cout << "Covered bytes must be \"all\" or <start>:<length> with a positive length\n";
+                return 0;
+            }
+        }
+        if (cover_len != 0 && format_version == 1)
+        {
+            cout << "A covering index needs node format 2 or 3\n";
+            return 0;
+        }
+        int_keys = has_flag(argc, argv, 5, "-intkeys");
+        if (int_keys && format_version == 1)
+        {
+            cout << "Integer keys need node format 2 or 3\n";
+            return 0;
+        }
+        copy_on_write = has_flag(argc, argv, 5, "-cow");
         create_index(data_filename, index_file, keylen, -1, false);
     }
     else if (choice.compare("-find") == 0) // ./a.out -find data1.indx 11111111111111A 
@@ -881,12 +7444,41 @@ int main(int argc, char **argv)
         string target_key(argv[3]);
         find_index(index_file, target_key);
     }
+    else if (choice.compare("-findbatch") == 0) // ./a.out -findbatch data1.indx keys.txt
+    {
+        string index_file(argv[2]);
+        string keys_file(argv[3]);
+        find_batch(index_file, keys_file);
+    }
+    else if (choice.compare("-iobench") == 0) // ./a.out -iobench data1.indx keys.txt [-scan 100000]
+    {
+        string index_file(argv[2]);
+        string keys_file(argv[3]);
+        long scan_count = stol(get_option(argc, argv, 4, "-scan", "100000"));
+        io_benchmark(index_file, keys_file, scan_count);
+    }
     else if (choice.compare("-insert") == 0) // ./a.out -insert MyIndex.indx "64541668700164B Some new Record"
     {
         string index_file(argv[2]);
         string target_key(argv[3]);
         insert_record(index_file, target_key);
     }
+    else if (choice.compare("-insertbatch") == 0) // ./a.out -insertbatch MyIndex.indx new_records.txt
+    {
+        string index_file(argv[2]);
+        string records_file(argv[3]);
+        insert_batch(index_file, records_file);
+    }
+    else if (choice.compare("-checkpoint") == 0) // ./a.out -checkpoint MyIndex.indx
+    {
+        string index_file(argv[2]);
+        checkpoint_index(index_file);
+    }
+    else if (choice.compare("-sync") == 0) // ./a.out -sync MyIndex.indx
+    {
+        string index_file(argv[2]);
+        sync_index(index_file);
+    }
     else if (choice.compare("-list") == 0) // ./a.out -list <index filename> <starting key> <count>
     {
         string index_file(argv[2]);
@@ -894,5 +7486,61 @@ int main(int argc, char **argv)
         int count = stoi(argv[4]);
         list_records(index_file, target_key, count);
     }
+
+    else if (choice.compare("-count") == 0) // ./a.out -count data1.indx 11111111111111A 22222222222222A
+    {
+        if (argc < 5)
+        {
+            cout << "Incorrect number of arguments\n";
+            return 0;
+        }
+        string index_file(argv[2]);
+        order_statistic_index(index_file, "count", argv[3], argv[4]);
+    }
+    else if (choice.compare("-rank") == 0 || choice.compare("-select") == 0) // ./a.out -rank data1.indx 11111111111111A, ./a.out -select data1.indx 1000
+    {
+        if (choice.compare("-select") == 0 && !is_position(argv[3]))
+        {
+            cout << "Usage: -select <index file> <position>, the position a record number from 0\n";
+            return 0;
+        }
+        string index_file(argv[2]);
+        order_statistic_index(index_file, choice.substr(1), argv[3], "");
+    }
+    else if (choice.compare("-stress") == 0) // ./a.out -stress data1.indx 8 [-seconds 2] [-writer]
+    {
+        string index_file(argv[2]);
+        int threads = stoi(argv[3]);
+        double seconds = stod(get_option(argc, argv, 4, "-seconds", "2"));
+        if (threads < 1 || seconds <= 0)
+        {
+            cout << "Thread count and duration must be positive\n";
+            return 0;
+        }
+        stress_index(index_file, threads, seconds, has_flag(argc, argv, 4, "-writer"));
+    }
+    else if (choice.compare("-serve") == 0) // ./a.out -serve data1.indx /tmp/index.sock
+    {
+        string index_file(argv[2]);
+        string socket_path(argv[3]);
+        serve_index(index_file, socket_path);
+    }
+    else if (choice.compare("-client") == 0) // ./a.out -client /tmp/index.sock "find 11111111111111A"
+    {
+        string socket_path(argv[2]);
+        string request(argv[3]);
+        run_client(socket_path, request);
+    }
+
+    if (print_stats)
+        buffer_pool.print_stats();
+    if (print_stats && bloom.lines > 0)
+        bloom.print_stats();
+    if (print_stats && inner_levels.active)
+        inner_levels.print_stats();
+    if (print_stats && wal.active)
+        wal.print_stats();
+    if (print_stats && shadow.active)
+        shadow.print_stats();
     return 0;
 }